@@ -24,8 +24,10 @@ bc_pgfault(struct UTrapframe *utf) {
     /* Check that the fault was within the block cache region */
     if (addr < (void *)DISKMAP || addr >= (void *)(DISKMAP + DISKSIZE)) return 0;
 
-    /* Sanity check the block number. */
-    if (super && blockno >= super->s_nblocks)
+    /* Sanity check the block number.
+     * (super block itself might have been dropped from the cache,
+     * don't fault on it from within the handler) */
+    if (super && is_page_present(super) && blockno >= super->s_nblocks)
         panic("reading non-existent block %08x out of %08x\n", blockno, super->s_nblocks);
 
     /* Allocate a page in the disk map region, read the contents
@@ -35,13 +37,21 @@ bc_pgfault(struct UTrapframe *utf) {
     // LAB 10: Your code here
     int err;
     addr = ROUNDDOWN(addr, BLKSIZE);
-    if ((err = sys_alloc_region(CURENVID, addr, BLKSIZE, PROT_RW)))
+    if ((err = sys_alloc_region(CURENVID, addr, BLKSIZE, PROT_RW | ALLOC_POPULATE)))
         panic("bc_pgfault couldn't alloc region: %i", err);
 
+    /* The block is read by DMA, so it has to be backed by its own page.
+     * ALLOC_POPULATE normally does that without another fault,
+     * but falls back to lazy mapping when memory is short */
     *(char *)addr = 0;
 
     if ((err = nvme_read(blockno * BLKSECTS, addr, BLKSECTS)))
         panic("bc_pgfault couldn't read the block: %i", err);
+
+    /* Block matches the disk now, so clear PTE_D to let
+     * kernel drop it under memory pressure */
+    if ((err = sys_map_region(CURENVID, addr, CURENVID, addr, BLKSIZE, PTE_SYSCALL & get_prot(addr))))
+        panic("bc_pgfault couldn't map region: %i", err);
     return 1;
 }
 
@@ -111,6 +121,10 @@ bc_init(void) {
     add_pgfault_handler(bc_pgfault);
     check_bc();
 
+    /* Clean blocks can always be read again */
+    int res = sys_env_set_cache_region(CURENVID, (void *)DISKMAP, DISKSIZE);
+    if (res < 0) panic("sys_env_set_cache_region: %i", res);
+
     /* Cache the super block by reading it once */
     memmove(&super, diskaddr(1), sizeof super);
 }
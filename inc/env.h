@@ -47,8 +47,27 @@ enum EnvType {
     ENV_TYPE_FS, /* File system server */
 };
 
+/* Memory management flags in struct Env */
+#define ENV_MM_THP 0x1 /* Collapse populated 2M ranges into huge pages */
+#define ENV_MM_KSM 0x2 /* Merge identical private pages */
+#define ENV_MM_ALL (ENV_MM_THP | ENV_MM_KSM)
+
+/* Scheduler priority levels (0 is the highest) */
+#define SCHED_LEVELS       4
+#define SCHED_PRIO_DEFAULT 1
+/* Fair class weights, virtual runtime of env with
+ * default weight advances at the rate of TSC */
+#define SCHED_WEIGHT_DEFAULT 1024
+#define SCHED_WEIGHT_MAX     65536
+
+/* Fault-around window in pages (power of 2 up to 2M) */
+#define FAULT_AROUND_DEFAULT 16
+#define FAULT_AROUND_MAX     512
+
+/* Links are 32-bit offsets of elements from KERN_BASE_ADDR
+ * (list elements are always allocated in boot memory) */
 struct List {
-    struct List *prev, *next;
+    uint32_t prev, next;
 };
 
 struct AddressSpace {
@@ -64,17 +83,38 @@ struct AddressSpace {
      * Есть MAPPING_NODE (конечная нода), есть INTERMEDIATE_NODE
     */
     struct Page *root; /* root node of address space tree */
+
+    uint16_t pcid;     /* Process-context identifier (if enabled) */
+    uint64_t pcid_gen; /* Generation pcid belongs to (0 if not assigned) */
+    uint64_t pml4_gen; /* Kernel PML4 generation the upper half was copied from */
+
+    size_t resident; /* Bytes mapped in the tree */
+    size_t shared;   /* Part of them mapped with PROT_SHARE or PROT_LAZY */
 };
 
 
 struct Env {
     struct Trapframe env_tf; /* Saved registers */
     struct Env *env_link;    /* Next free Env */
+    struct Env *env_rq_next; /* Run queue links (ENV_RUNNABLE envs only) */
+    struct Env *env_rq_prev;
     envid_t env_id;          /* Unique environment identifier */
     envid_t env_parent_id;   /* env_id of this env's parent */
     enum EnvType env_type;   /* Indicates special system environments */
     unsigned env_status;     /* Status of the environment */
     uint32_t env_runs;       /* Number of times environment has run */
+    uint8_t env_priority;     /* Base scheduler level */
+    uint8_t env_sched_level;  /* Current scheduler level */
+    uint32_t env_sched_ticks; /* Timer ticks used at current level */
+    uint32_t env_weight;      /* Fair class weight (0 if env is in MLFQ) */
+    uint32_t env_heap_index;  /* Position in fair class heap */
+    uint64_t env_vruntime;    /* Weighted user mode cycles (fair class only) */
+
+    /* CPU accounting (user space can sample it through UENVS) */
+    uint64_t env_user_cycles;          /* TSC cycles spent in user mode */
+    uint64_t env_kernel_cycles;        /* Spent in kernel on behalf of env */
+    uint32_t env_voluntary_switches;   /* Gave up CPU itself */
+    uint32_t env_involuntary_switches; /* Preempted by timer */
 
     uint8_t *binary; /* Pointer to process ELF image in kernel memory */
 
@@ -84,6 +124,18 @@ struct Env {
     /* Exception handling */
     void *env_pgfault_upcall; /* Page fault upcall entry point */
 
+    uint32_t env_mm_flags; /* Memory management flags (ENV_MM_*) */
+    /* Clean private pages within [env_cache_va, env_cache_va + env_cache_size)
+     * can be dropped under memory pressure (they are refaulted by env) */
+    uintptr_t env_cache_va;
+    size_t env_cache_size;
+    /* Lazy pages within aligned window of this many pages around
+     * the faulting one are resolved along with it (0 disables) */
+    uint32_t env_fault_around;
+    uint64_t env_faults;              /* Page faults resolved by kernel */
+    uint64_t env_fault_around_pages; /* Pages resolved ahead of access */
+    uint64_t env_user_faults;        /* Page faults passed to upcall */
+
     /* LAB 9 IPC */
     bool env_ipc_recving;    /* Env is blocked receiving */
     uintptr_t env_ipc_dstva; /* VA at which to map received page */
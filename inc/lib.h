@@ -15,6 +15,8 @@
 #include <inc/assert.h>
 #include <inc/env.h>
 #include <inc/memlayout.h>
+#include <inc/memstat.h>
+#include <inc/shm.h>
 #include <inc/syscall.h>
 #include <inc/trap.h>
 #include <inc/fs.h>
@@ -55,8 +57,18 @@ char *readline(const char *buf);
 #define CURENVID 0
 
 /* sys_alloc_region() specific flags */
-#define ALLOC_ZERO 0x100000 /* Allocate memory filled with 0x00 */
-#define ALLOC_ONE  0x200000 /* Allocate memory filled with 0xFF */
+#define ALLOC_ZERO     0x100000  /* Allocate memory filled with 0x00 */
+#define ALLOC_ONE      0x200000  /* Allocate memory filled with 0xFF */
+#define ALLOC_POPULATE 0x800000  /* Allocate memory right away instead of lazily */
+#define ALLOC_HUGE     0x1000000 /* Back 2M/1G-aligned parts with huge pages right away */
+
+/* sys_region_advise() advice */
+#define ADVISE_NORMAL     0 /* Default fault-around */
+#define ADVISE_RANDOM     1 /* Disable fault-around */
+#define ADVISE_SEQUENTIAL 2 /* Maximal fault-around */
+#define ADVISE_WILLNEED   3 /* Allocate lazily mapped memory now */
+#define ADVISE_DONTNEED   4 /* Drop memory, leaving it zero-filled */
+#define ADVISE_FREE       5 /* Allow dropping memory until it is written */
 
 /* Memory protection flags & attributes
  * NOTE These should be in-sync with kern/pmap.h
@@ -85,6 +97,17 @@ static envid_t sys_exofork(void);
 int sys_env_set_status(envid_t env, int status);
 int sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int sys_env_set_mm_flags(envid_t env, uint32_t flags);
+int sys_env_set_cache_region(envid_t env, void *va, size_t size);
+int sys_env_set_fault_around(envid_t env, size_t npages);
+int sys_env_set_priority(envid_t env, int priority);
+int sys_env_set_weight(envid_t env, unsigned weight);
+int sys_region_advise(envid_t env, void *va, size_t size, int advice);
+shmid_t sys_shm_open(const char *name, size_t size, int flags);
+int sys_shm_resize(shmid_t shm, size_t size);
+int sys_shm_map(shmid_t shm, envid_t env, void *va, size_t offset, size_t size, int perm);
+int sys_shm_unlink(shmid_t shm);
+int sys_memstat(envid_t env, struct MemStat *stat);
 int sys_alloc_region(envid_t env, void *pg, size_t size, int perm);
 int sys_map_region(envid_t src_env, void *src_pg,
                    envid_t dst_env, void *dst_pg, size_t size, int perm);
@@ -0,0 +1,74 @@
+#ifndef JOS_INC_MEMSTAT_H
+#define JOS_INC_MEMSTAT_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+/* Number of page classes (4K << N) counters are kept for */
+#define MEMSTAT_CLASSES 48
+/* Fault counters are kept for classes 4K..2M,
+ * the last one also counts larger faults */
+#define MEMSTAT_FAULT_CLASSES 10
+#define MEMSTAT_HUGE_CLASS    (MEMSTAT_FAULT_CLASSES - 1)
+
+/* Memory manager statistics returned by sys_memstat() */
+struct MemStat {
+    /* Physical memory */
+    uint64_t free_bytes;                       /* Free memory in buddy allocator */
+    uint64_t free_blocks[MEMSTAT_CLASSES];     /* Free blocks of each class */
+    uint64_t cached_bytes;                     /* Memory held by magazines and zero pools */
+    uint64_t slab_bytes;                       /* Memory held by kernel object allocator */
+
+    /* Page descriptors */
+    uint64_t desc_total;
+    uint64_t desc_free;
+    uint64_t desc_pools;
+
+    /* Page faults resolved by the kernel, by page class */
+    uint64_t cow_faults[MEMSTAT_FAULT_CLASSES];   /* Page was copied */
+    uint64_t zero_faults[MEMSTAT_FAULT_CLASSES];  /* Zero-filled page was allocated */
+    uint64_t reuse_faults[MEMSTAT_FAULT_CLASSES]; /* Only reference, page was remapped writable */
+    uint64_t oom_faults;                          /* Fault failed even after reclaim */
+
+    /* Deferred address space teardown (cycles are totals) */
+    uint64_t teardown_pending;
+    uint64_t teardown_done;
+    uint64_t teardown_release_cycles; /* Spent in env_free() */
+    uint64_t teardown_work_cycles;    /* Spent freeing queued spaces */
+    uint64_t teardown_wait_cycles;    /* From queueing to completion */
+
+    /* Memory reclaim */
+    uint64_t reclaim_runs;
+    uint64_t reclaimed_bytes;
+
+    /* Page tables shared by fork() */
+    uint64_t pt_shared;  /* 2M ranges shared */
+    uint64_t pt_copied;  /* Copied on first private access */
+    uint64_t pt_adopted; /* Taken over by the last address space using it */
+
+    /* Huge page collapse (ENV_MM_THP) */
+    uint64_t thp_scanned;   /* 2M ranges looked at */
+    uint64_t thp_collapsed; /* 2M ranges remapped with huge page */
+    uint64_t thp_nomem;     /* Collapses failed due to lack of 2M pages */
+
+    /* Same-page merging (ENV_MM_KSM) */
+    uint64_t ksm_scanned;     /* Pages hashed */
+    uint64_t ksm_merged;      /* Pages mapped to identical page */
+    uint64_t ksm_zero;        /* Pages mapped to zero page */
+    uint64_t ksm_saved_bytes; /* Memory not used thanks to merging */
+
+    /* Physical memory compaction */
+    uint64_t compact_runs;
+    uint64_t compact_blocks; /* 2M blocks freed */
+    uint64_t compact_moved;  /* Pages moved */
+    uint64_t compact_failed; /* Blocks that could not be freed */
+
+    /* Address space of requested environment */
+    envid_t env_id;
+    uint64_t env_resident; /* Bytes mapped */
+    uint64_t env_shared;   /* Bytes mapped shared or copy-on-write */
+    uint64_t env_faults;             /* Page faults resolved by kernel */
+    uint64_t env_fault_around_pages; /* Pages resolved ahead by fault-around */
+};
+
+#endif /* !JOS_INC_MEMSTAT_H */
@@ -139,6 +139,10 @@
 #define CR4_SMAP       0x00200000 /* SMAP Enable */
 #define CR4_PKE        0x00400000 /* Protected Key Enable */
 
+/* CR3 bits used when CR4.PCIDE is set */
+#define CR3_PCID_MASK 0xFFFULL     /* Process-context identifier */
+#define CR3_NOFLUSH   (1ULL << 63) /* Preserve TLB entries of loaded PCID */
+
 /* x86_64 related changes */
 #define EFER_MSR 0xC0000080
 #define EFER_LME (1ULL << 8)
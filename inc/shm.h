@@ -0,0 +1,21 @@
+#ifndef JOS_INC_SHM_H
+#define JOS_INC_SHM_H
+
+#include <inc/types.h>
+
+/* Shared memory object handles are built like envids:
+ * index in the object table and generation number */
+typedef int32_t shmid_t;
+
+#define LOG2NSHM    6
+#define NSHM        (1 << LOG2NSHM)
+#define SHMX(shmid) ((shmid) & (NSHM - 1))
+
+/* Maximal length of object name */
+#define SHM_NAME_MAX 31
+
+/* sys_shm_open() flags */
+#define SHM_CREATE 0x1 /* Create object if it does not exist */
+#define SHM_EXCL   0x2 /* Fail if object already exists */
+
+#endif /* !JOS_INC_SHM_H */
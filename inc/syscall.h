@@ -19,6 +19,17 @@ enum {
     SYS_yield,
     SYS_ipc_try_send,
     SYS_ipc_recv,
+    SYS_env_set_mm_flags,
+    SYS_memstat,
+    SYS_env_set_cache_region,
+    SYS_env_set_fault_around,
+    SYS_region_advise,
+    SYS_shm_open,
+    SYS_shm_resize,
+    SYS_shm_map,
+    SYS_shm_unlink,
+    SYS_env_set_priority,
+    SYS_env_set_weight,
     NSYSCALLS
 };
 
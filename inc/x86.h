@@ -245,6 +245,33 @@ cpuid(uint32_t info, uint32_t *raxp, uint32_t *rbxp, uint32_t *rcxp, uint32_t *r
     if (rdxp) *rdxp = edx;
 }
 
+static inline void __attribute__((always_inline))
+cpuid_count(uint32_t info, uint32_t count, uint32_t *raxp, uint32_t *rbxp, uint32_t *rcxp, uint32_t *rdxp) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid"
+                 : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                 : "a"(info), "c"(count));
+    if (raxp) *raxp = eax;
+    if (rbxp) *rbxp = ebx;
+    if (rcxp) *rcxp = ecx;
+    if (rdxp) *rdxp = edx;
+}
+
+/* INVPCID invalidation types */
+#define INVPCID_ADDR        0 /* Single address in single PCID */
+#define INVPCID_CONTEXT     1 /* All addresses in single PCID */
+#define INVPCID_ALL_GLOBAL  2 /* All PCIDs including global pages */
+#define INVPCID_ALL_NOGLOBL 3 /* All PCIDs except global pages */
+
+static inline void __attribute__((always_inline))
+invpcid(uint64_t type, uint64_t pcid, uintptr_t addr) {
+    struct {
+        uint64_t pcid, addr;
+    } desc = {pcid, addr};
+    asm volatile("invpcid %0, %1" ::"m"(desc), "r"(type)
+                 : "memory");
+}
+
 static inline uint64_t __attribute__((always_inline))
 read_tsc(void) {
     uint32_t lo, hi;
@@ -253,6 +280,19 @@ read_tsc(void) {
     return (uint64_t)lo | ((uint64_t)hi << 32);
 }
 
+/* Store bypassing cache (used for clearing memory that is not read soon) */
+static inline void __attribute__((always_inline))
+movnti(uint64_t *addr, uint64_t val) {
+    asm volatile("movnti %1, %0"
+                 : "=m"(*addr)
+                 : "r"(val));
+}
+
+static inline void __attribute__((always_inline))
+sfence(void) {
+    asm volatile("sfence" ::: "memory");
+}
+
 static inline uint32_t __attribute__((always_inline))
 xchg(volatile uint32_t *addr, uint32_t newval) {
     uint32_t result = __atomic_exchange_n(addr, newval, __ATOMIC_ACQ_REL);
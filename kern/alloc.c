@@ -1,112 +1,407 @@
 #include <inc/types.h>
-#include <kern/alloc.h>
 #include <inc/assert.h>
-#include <kern/spinlock.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/alloc.h>
+#include <kern/pmap.h>
+
+/*
+ * Kernel object allocator.
+ *
+ * Objects are carved from slabs -- blocks of physically contiguous
+ * pages obtained with kalloc_pages(). Every slab starts with a header
+ * and is aligned on its size, so the header of an object is found by
+ * rounding its address down. Objects of custom caches with slabs larger
+ * than a page should be freed with kmem_cache_free().
+ *
+ * Constructors are called once when slab is created,
+ * so objects should be returned to the cache in constructed state.
+ *
+ * kmalloc() is served by power-of-two caches with one-page slabs,
+ * allocations larger than KMALLOC_MAX_CACHED take whole pages
+ * prefixed with a small header.
+ */
+
+#define KMEM_SLAB_MAGIC  0x51AB51AB
+#define KMEM_LARGE_MAGIC 0x1A46E000
+
+/* Try to fit at least this many objects into custom cache slab... */
+#define KMEM_MIN_OBJS 8
+/* ...but don't make slabs larger than this class */
+#define KMEM_MAX_SLAB_CLASS 4
+/* Completely free slabs kept by cache to avoid page allocator trips */
+#define KMEM_EMPTY_KEEP 1
+
+struct Slab {
+    uint32_t magic;
+    uint32_t inuse; /* Number of allocated objects */
+    struct KmemCache *cache;
+    struct Slab *prev, *next;
+    void *freelist; /* Free objects linked through their first word */
+};
+
+struct LargeHeader {
+    uint32_t magic;
+    int class;
+    size_t size;
+} __attribute__((aligned(KMALLOC_ALIGN)));
+
+struct KmemCache {
+    const char *name;
+    size_t size;  /* Object size rounded up to alignment */
+    size_t align; /* Object alignment */
+    void (*ctor)(void *obj);
+
+    int class;            /* Slab page class */
+    size_t objs_per_slab; /* 0 until cache is set up */
+    size_t offset;        /* First object offset within slab */
+
+    struct Slab *partial; /* Slabs with both free and used objects */
+    struct Slab *full;    /* Slabs without free objects */
+    struct Slab *empty;   /* Slabs without used objects */
+    size_t nempty;
+
+    /* Statistics */
+    size_t allocs, frees, active;
+    size_t slabs, grows, shrinks;
+
+    struct KmemCache *next; /* All caches link */
+};
 
-#define SPACE_SIZE 5 * 0x1000
+static struct KmemCache kmalloc_caches[] = {
+        {.name = "kmalloc-16", .size = 16},
+        {.name = "kmalloc-32", .size = 32},
+        {.name = "kmalloc-64", .size = 64},
+        {.name = "kmalloc-128", .size = 128},
+        {.name = "kmalloc-256", .size = 256},
+        {.name = "kmalloc-512", .size = 512},
+        {.name = "kmalloc-1024", .size = 1024},
+};
+#define KMALLOC_NCACHES (sizeof(kmalloc_caches) / sizeof(*kmalloc_caches))
 
-static uint8_t space[SPACE_SIZE];
+static_assert(16 << (KMALLOC_NCACHES - 1) == KMALLOC_MAX_CACHED, "kmalloc caches should cover KMALLOC_MAX_CACHED");
 
-/* empty list to get started */
-static Header base = {.next = (Header *)space, .prev = (Header *)space};
-/* start of free list */
-static Header *freep = NULL;
+/* Cache of custom cache descriptors */
+static struct KmemCache cache_cache = {.name = "kmem_cache", .size = sizeof(struct KmemCache)};
+
+/* List of custom caches */
+static struct KmemCache *custom_caches;
+
+static size_t large_allocs, large_frees, large_pages;
+
+/* Allocator can be called from kernel-space environments which
+ * might be preempted, so just disable interrupts (NCPU == 1) */
+static inline uint64_t
+kmem_lock(void) {
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+    return rflags;
+}
+
+static inline void
+kmem_unlock(uint64_t rflags) {
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+}
 
 static void
-check_list(void) {
-    asm volatile("cli");
-    Header *prevp = freep, *p = prevp->next;
-    for (; p != freep; p = p->next) {
-        if (prevp != p->prev) panic("Corrupted list.\n");
-        prevp = p;
-    }
-    asm volatile("sti");
+slab_list_add(struct Slab **list, struct Slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
 }
 
-/* malloc: general-purpose storage allocator */
-void *
-test_alloc(uint8_t nbytes) {
+static void
+slab_list_del(struct Slab **list, struct Slab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+}
 
-    /* Make allocator thread-safe with the help of spin_lock/spin_unlock. */
-    // LAB 5: Your code here:
-    spin_lock(&kernel_lock);
+static void
+kmem_cache_setup(struct KmemCache *cache, bool onepage) {
+    if (!cache->align) cache->align = KMALLOC_ALIGN;
+    cache->size = ROUNDUP(MAX(cache->size, sizeof(void *)), cache->align);
+    cache->offset = ROUNDUP(sizeof(struct Slab), cache->align);
+
+    cache->class = 0;
+    while (!onepage && cache->class < KMEM_MAX_SLAB_CLASS &&
+           (CLASS_SIZE(cache->class) - cache->offset) / cache->size < KMEM_MIN_OBJS)
+        cache->class++;
 
-    size_t nunits = (nbytes + sizeof(Header) - 1) / sizeof(Header) + 1;
+    cache->objs_per_slab = (CLASS_SIZE(cache->class) - cache->offset) / cache->size;
+    assert(cache->objs_per_slab);
+}
 
-    /* no free list yet */
-    if (!freep) {
-        Header *hd = (Header *)&space;
+static struct Slab *
+kmem_cache_grow(struct KmemCache *cache) {
+    struct Slab *slab = kalloc_pages(cache->class);
+    if (!slab) return NULL;
 
-        hd->next = (Header *)&base;
-        hd->prev = (Header *)&base;
-        hd->size = (SPACE_SIZE - sizeof(Header)) / sizeof(Header);
+    slab->magic = KMEM_SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = cache;
+    slab->freelist = NULL;
 
-        freep = &base;
+    /* Build free list so that objects are handed out in address order */
+    uint8_t *obj = (uint8_t *)slab + cache->offset + (cache->objs_per_slab - 1) * cache->size;
+    for (size_t i = 0; i < cache->objs_per_slab; i++, obj -= cache->size) {
+        if (cache->ctor) cache->ctor(obj);
+        *(void **)obj = slab->freelist;
+        slab->freelist = obj;
     }
 
-    check_list();
-
-    for (Header *p = freep->next;; p = p->next) {
-        /* big enough */
-        if (p->size >= nunits) {
-            freep = p->prev;
-            /* exactly */
-            if (p->size == nunits) {
-                p->prev->next = p->next;
-                p->next->prev = p->prev;
-            } else { /* allocate tail end */
-                p->size -= nunits;
-                p += p->size;
-                p->size = nunits;
-            }
-            spin_unlock(&kernel_lock);
-            return (void *)(p + 1);
+    cache->slabs++;
+    cache->grows++;
+    return slab;
+}
+
+static void *
+do_cache_alloc(struct KmemCache *cache) {
+    struct Slab *slab = cache->partial;
+    if (!slab && (slab = cache->empty)) {
+        slab_list_del(&cache->empty, slab);
+        cache->nempty--;
+        slab_list_add(&cache->partial, slab);
+    }
+    if (!slab) {
+        if (!(slab = kmem_cache_grow(cache))) return NULL;
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void *obj = slab->freelist;
+    slab->freelist = *(void **)obj;
+    if (++slab->inuse == cache->objs_per_slab) {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    cache->allocs++;
+    cache->active++;
+    return obj;
+}
+
+static void
+do_cache_free(struct KmemCache *cache, struct Slab *slab, void *obj) {
+    assert(slab->magic == KMEM_SLAB_MAGIC && slab->cache == cache);
+    assert(slab->inuse);
+
+    if (slab->inuse-- == cache->objs_per_slab) {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+
+    if (!slab->inuse) {
+        slab_list_del(&cache->partial, slab);
+        if (cache->nempty < KMEM_EMPTY_KEEP) {
+            slab_list_add(&cache->empty, slab);
+            cache->nempty++;
+        } else {
+            slab->magic = 0;
+            kfree_pages(slab, cache->class);
+            cache->slabs--;
+            cache->shrinks++;
         }
+    }
+
+    cache->frees++;
+    cache->active--;
+}
+
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)) {
+    if (!size || (align & (align - 1)) || align > PAGE_SIZE) return NULL;
+
+    uint64_t rflags = kmem_lock();
+
+    if (!cache_cache.objs_per_slab) kmem_cache_setup(&cache_cache, 0);
+    struct KmemCache *cache = do_cache_alloc(&cache_cache);
+    if (cache) {
+        memset(cache, 0, sizeof *cache);
+        cache->name = name;
+        cache->size = size;
+        cache->align = MAX(align, sizeof(void *));
+        cache->ctor = ctor;
+        kmem_cache_setup(cache, 0);
+
+        cache->next = custom_caches;
+        custom_caches = cache;
+    }
 
-        /* wrapped around free list */
-        if (p == freep) {
-            spin_unlock(&kernel_lock);
-            return NULL;
+    kmem_unlock(rflags);
+    return cache;
+}
+
+void *
+kmem_cache_alloc(struct KmemCache *cache) {
+    uint64_t rflags = kmem_lock();
+    void *obj = do_cache_alloc(cache);
+    kmem_unlock(rflags);
+    return obj;
+}
+
+void
+kmem_cache_free(struct KmemCache *cache, void *obj) {
+    if (!obj) return;
+
+    uint64_t rflags = kmem_lock();
+    struct Slab *slab = (struct Slab *)ROUNDDOWN((uintptr_t)obj, CLASS_SIZE(cache->class));
+    do_cache_free(cache, slab, obj);
+    kmem_unlock(rflags);
+}
+
+void *
+kmalloc(size_t size) {
+    if (!size) return NULL;
+
+    if (size > KMALLOC_MAX_CACHED) {
+        int class = 0;
+        while (CLASS_SIZE(class) < size + sizeof(struct LargeHeader)) class++;
+
+        uint64_t rflags = kmem_lock();
+        struct LargeHeader *hdr = kalloc_pages(class);
+        if (hdr) {
+            hdr->magic = KMEM_LARGE_MAGIC;
+            hdr->class = class;
+            hdr->size = size;
+            large_allocs++;
+            large_pages += CLASS_SIZE(class) / PAGE_SIZE;
         }
+        kmem_unlock(rflags);
+
+        return hdr ? hdr + 1 : NULL;
     }
+
+    struct KmemCache *cache = kmalloc_caches;
+    while (cache->size < size) cache++;
+
+    uint64_t rflags = kmem_lock();
+    if (!cache->objs_per_slab) kmem_cache_setup(cache, 1);
+    void *obj = do_cache_alloc(cache);
+    kmem_unlock(rflags);
+
+    return obj;
+}
+
+void *
+kzalloc(size_t size) {
+    void *ptr = kmalloc(size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
 }
 
-/* free: put block ap in free list */
 void
-test_free(void *ap) {
+kfree(void *ptr) {
+    if (!ptr) return;
+
+    /* Both slab and large allocation headers
+     * are located at the start of the first page */
+    void *base = (void *)ROUNDDOWN((uintptr_t)ptr, PAGE_SIZE);
+    uint64_t rflags = kmem_lock();
 
-    /* point to block header */
-    Header *bp = (Header *)ap - 1;
-
-    /* Make allocator thread-safe with the help of spin_lock/spin_unlock. */
-    // LAB 5: Your code here
-    spin_lock(&kernel_lock);
-
-    /* freed block at start or end of arena */
-    Header *p = freep;
-    for (; !(bp > p && bp < p->next); p = p->next)
-        if (p >= p->next && (bp > p || bp < p->next)) break;
-
-    if (bp + bp->size == p->next && p + p->size == bp) /* join to both */ {
-        p->size += bp->size + p->next->size;
-        p->next->next->prev = p;
-        p->next = p->next->next;
-    } else if (bp + bp->size == p->next) /* join to upper nbr */ {
-        bp->size += p->next->size;
-        bp->next = p->next->next;
-        bp->prev = p->next->prev;
-        p->next->next->prev = bp;
-        p->next = bp;
-    } else if (p + p->size == bp) /* join to lower nbr */ {
-        p->size += bp->size;
+    if (*(uint32_t *)base == KMEM_LARGE_MAGIC) {
+        struct LargeHeader *hdr = base;
+        assert(ptr == hdr + 1);
+        hdr->magic = 0;
+        large_frees++;
+        large_pages -= CLASS_SIZE(hdr->class) / PAGE_SIZE;
+        kfree_pages(hdr, hdr->class);
     } else {
-        bp->next = p->next;
-        bp->prev = p;
-        p->next->prev = bp;
-        p->next = bp;
+        struct Slab *slab = base;
+        if (slab->magic != KMEM_SLAB_MAGIC || slab->cache->class)
+            panic("kfree: %p was not allocated with kmalloc()\n", ptr);
+        do_cache_free(slab->cache, slab, ptr);
     }
-    freep = p;
 
-    check_list();
-    spin_unlock(&kernel_lock);
+    kmem_unlock(rflags);
+}
+
+static size_t
+cache_reclaim(struct KmemCache *cache) {
+    size_t freed = 0;
+    while (cache->empty) {
+        struct Slab *slab = cache->empty;
+        slab_list_del(&cache->empty, slab);
+        slab->magic = 0;
+        kfree_pages(slab, cache->class);
+        freed += CLASS_SIZE(cache->class) / PAGE_SIZE;
+        cache->nempty--;
+        cache->slabs--;
+        cache->shrinks++;
+    }
+    return freed;
+}
+
+/* Give completely free slabs back to page allocator,
+ * returns number of freed pages */
+size_t
+kmem_reclaim(void) {
+    uint64_t rflags = kmem_lock();
+
+    size_t freed = 0;
+    for (size_t i = 0; i < KMALLOC_NCACHES; i++)
+        freed += cache_reclaim(&kmalloc_caches[i]);
+    for (struct KmemCache *cache = custom_caches; cache; cache = cache->next)
+        freed += cache_reclaim(cache);
+
+    kmem_unlock(rflags);
+    return freed;
+}
+
+/* Number of pages held by the allocator */
+size_t
+kmem_pages(void) {
+    uint64_t rflags = kmem_lock();
+
+    size_t pages = large_pages;
+    for (size_t i = 0; i < KMALLOC_NCACHES; i++)
+        pages += kmalloc_caches[i].slabs * (CLASS_SIZE(kmalloc_caches[i].class) / PAGE_SIZE);
+    pages += cache_cache.slabs * (CLASS_SIZE(cache_cache.class) / PAGE_SIZE);
+    for (struct KmemCache *cache = custom_caches; cache; cache = cache->next)
+        pages += cache->slabs * (CLASS_SIZE(cache->class) / PAGE_SIZE);
+
+    kmem_unlock(rflags);
+    return pages;
+}
+
+static void
+cache_dump_stats(struct KmemCache *cache) {
+    cprintf("%-16s %6zu %6zu %4lluK %6zu %8zu %10zu %10zu\n",
+            cache->name, cache->size, cache->objs_per_slab,
+            CLASS_SIZE(cache->class) / KB, cache->slabs,
+            cache->active, cache->allocs, cache->frees);
+}
+
+void
+kmem_dump_stats(void) {
+    cprintf("%-16s %6s %6s %5s %6s %8s %10s %10s\n",
+            "cache", "size", "objs", "slab", "slabs", "active", "allocs", "frees");
+    for (size_t i = 0; i < KMALLOC_NCACHES; i++)
+        cache_dump_stats(&kmalloc_caches[i]);
+    cache_dump_stats(&cache_cache);
+    for (struct KmemCache *cache = custom_caches; cache; cache = cache->next)
+        cache_dump_stats(cache);
+    cprintf("large: %zu allocs, %zu frees, %zu pages in use\n",
+            large_allocs, large_frees, large_pages);
+}
+
+/* malloc: general-purpose storage allocator */
+void *
+test_alloc(uint8_t nbytes) {
+    return kmalloc(nbytes);
+}
+
+/* free: put block ap in free list */
+void
+test_free(void *ap) {
+    kfree(ap);
 }
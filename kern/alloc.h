@@ -3,16 +3,28 @@
 
 #include <inc/types.h>
 
-/* block header */
-struct header {
-    /* next block */
-    struct header *next;
-    /* prev block */
-    struct header *prev;
-    /* size of this block */
-    size_t size;
-} __attribute__((packed, aligned(_Alignof(max_align_t))));
-
-typedef struct header Header;
+/* Minimal alignment of objects returned by kmalloc() */
+#define KMALLOC_ALIGN _Alignof(max_align_t)
+/* Largest size served from kmalloc caches, larger
+ * allocations take whole pages */
+#define KMALLOC_MAX_CACHED 1024
+
+struct KmemCache;
+
+struct KmemCache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(struct KmemCache *cache);
+void kmem_cache_free(struct KmemCache *cache, void *obj);
+
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+size_t kmem_reclaim(void);
+size_t kmem_pages(void);
+void kmem_dump_stats(void);
+
+/* Kept for kernel-space test programs */
+void *test_alloc(uint8_t nbytes);
+void test_free(void *ap);
 
 #endif
@@ -9,6 +9,12 @@
 
 #define NCPU 1
 
+/* Index of the current CPU (only the bootstrap processor is running) */
+static inline int
+cpunum(void) {
+    return 0;
+}
+
 /* Used by x86 to find stack for interrupt */
 extern struct Taskstate cpu_ts;
 
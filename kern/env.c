@@ -14,6 +14,7 @@
 #include <kern/pmap.h>
 #include <kern/pmap.h>
 #include <kern/sched.h>
+#include <kern/shm.h>
 #include <kern/timer.h>
 #include <kern/traceopt.h>
 #include <kern/trap.h>
@@ -104,6 +105,8 @@ env_init(void) {
     if (map_region(current_space, UENVS, &kspace, (uintptr_t)envs, UENVS_SIZE, PROT_R | PROT_USER_))
         panic("Cannot map physical region at %p of size %zd", envs, (size_t)UENVS_SIZE);
 
+    static_assert(sizeof(struct Env) * NENV <= UENVS_SIZE, "envs should fit in UENVS");
+
     /* Set up envs array */
 
     // LAB 3: Your code here
@@ -149,7 +152,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
 #else
     env->env_type = type;
 #endif
-    env->env_status = ENV_RUNNABLE;
+    /* File system server should not wait behind CPU-bound envs */
+    env_set_priority(env, type == ENV_TYPE_FS ? 0 : SCHED_PRIO_DEFAULT);
+    env_set_weight(env, 0);
+    env_set_status(env, ENV_RUNNABLE);
     env->env_runs = 0;
 
     /* Clear out all the saved register state,
@@ -190,6 +196,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
     /* Clear the page fault handler until user installs one. */
     env->env_pgfault_upcall = 0;
 
+    /* Memory management features are opt-in */
+    env->env_mm_flags = 0;
+    env->env_cache_va = env->env_cache_size = 0;
+    env->env_fault_around = FAULT_AROUND_DEFAULT;
+    env->env_faults = env->env_fault_around_pages = env->env_user_faults = 0;
+    env->env_user_cycles = env->env_kernel_cycles = 0;
+    env->env_voluntary_switches = env->env_involuntary_switches = 0;
+
     /* Also clear the IPC receiving flag. */
     env->env_ipc_recving = 0;
 
@@ -379,8 +393,11 @@ env_free(struct Env *env) {
     release_address_space(&env->address_space);
 #endif
 
+    /* Shared memory objects nobody can remove anymore */
+    shm_env_free(env);
+
     /* Return the environment to the free list */
-    env->env_status = ENV_FREE;
+    env_set_status(env, ENV_FREE);
     env->env_link = env_free_list;
     env_free_list = env;
 }
@@ -490,14 +507,16 @@ env_run(struct Env *env) {
 
     // LAB 3: Your code here
     // LAB 8: Your code here
+    if (curenv && curenv != env) sched_switch_out(curenv);
     if (curenv && curenv->env_status == ENV_RUNNING) {
-        curenv->env_status = ENV_RUNNABLE;
+        env_set_status(curenv, ENV_RUNNABLE);
     }
 
     curenv = env;
-    curenv->env_status = ENV_RUNNING;
+    env_set_status(curenv, ENV_RUNNING);
     curenv->env_runs++;
     switch_address_space(&curenv->address_space);
+    sched_leave_kernel();
     env_pop_tf(&curenv->env_tf);
 
     while (1)
@@ -17,6 +17,7 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/trap.h>
+#include <kern/alloc.h>
 
 #define WHITESPACE "\t\r\n "
 #define MAXARGS    16
@@ -33,6 +34,11 @@ int mon_frequency(int argc, char **argv, struct Trapframe *tf);
 int mon_memory(int argc, char **argv, struct Trapframe *tf);
 int mon_pagetable(int argc, char **argv, struct Trapframe *tf);
 int mon_virt(int argc, char **argv, struct Trapframe *tf);
+int mon_pagecache(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbstat(int argc, char **argv, struct Trapframe *tf);
+int mon_thp(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_memstat(int argc, char **argv, struct Trapframe *tf);
 
 struct Command {
     const char *name;
@@ -53,6 +59,11 @@ static struct Command commands[] = {
         {"memory", "Display allocated memory pages", mon_memory},
         {"pagetable", "Display current page table", mon_pagetable},
         {"virt", "Display virtual memory tree", mon_virt},
+        {"pagecache", "Display page magazine and zero pool statistics", mon_pagecache},
+        {"tlbstat", "Display TLB invalidation statistics", mon_tlbstat},
+        {"thp", "Display transparent huge page statistics", mon_thp},
+        {"slabinfo", "Display kernel object allocator statistics", mon_slabinfo},
+        {"memstat", "Display memory usage and page fault statistics", mon_memstat},
 };
 #define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
 
@@ -156,6 +167,36 @@ mon_virt(int argc, char **argv, struct Trapframe *tf) {
     return 0;
 }
 
+int
+mon_pagecache(int argc, char **argv, struct Trapframe *tf) {
+    dump_page_caches();
+    return 0;
+}
+
+int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf) {
+    dump_tlb_stats();
+    return 0;
+}
+
+int
+mon_thp(int argc, char **argv, struct Trapframe *tf) {
+    dump_thp_stats();
+    return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf) {
+    kmem_dump_stats();
+    return 0;
+}
+
+int
+mon_memstat(int argc, char **argv, struct Trapframe *tf) {
+    dump_memstat();
+    return 0;
+}
+
 // LAB 4: Your code here
 int
 mon_dumpcmos(int argc, char **argv, struct Trapframe *tf) {
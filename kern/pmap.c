@@ -2,11 +2,14 @@
 
 #include <inc/assert.h>
 #include <inc/error.h>
+#include <inc/memstat.h>
 #include <inc/mmu.h>
 #include <inc/string.h>
 #include <inc/uefi.h>
 #include <inc/x86.h>
 
+#include <kern/alloc.h>
+#include <kern/cpu.h>
 #include <kern/env.h>
 #include <kern/kclock.h>
 #include <kern/pmap.h>
@@ -21,8 +24,21 @@
  * by struct Page
  */
 
+/* Free lists are split into blocks starting below BOOT_MEM_SIZE
+ * and blocks above it, so ALLOC_BOOTMEM never has to skip high memory */
+enum FreeZone {
+    FREE_LOW,
+    FREE_HIGH,
+    FREE_NZONES,
+};
 /* for O(1) page allocation */
-static struct List free_classes[MAX_CLASS];
+static struct List free_classes[FREE_NZONES][MAX_CLASS];
+/* Bit N is set iff free_classes[zone][N] is not empty */
+static uint64_t free_class_mask[FREE_NZONES];
+static_assert(MAX_CLASS <= 64, "Free class bitmap should fit in 64 bits");
+/* Number of free blocks of each class (in both zones) */
+static size_t free_class_count[MAX_CLASS];
+static_assert(MAX_CLASS == MEMSTAT_CLASSES, "struct MemStat should have counter for every class");
 /* List of descriptor pools */
 static struct PagePool *first_pool;
 /* List of free descriptors */
@@ -43,6 +59,18 @@ static uintptr_t metaheaptop;
 static bool nx_supported;
 /* 1GB pages are supported */
 static bool has_1gb_pages;
+/* Process-context identifiers are supported (and enabled) */
+static bool has_pcid, pcid_enabled;
+/* INVPCID instruction is supported */
+static bool has_invpcid;
+
+/* PCID 0 is reserved for kspace, user address spaces
+ * get the rest of them in round-robin manner.
+ * When identifiers run out new generation is started and every
+ * address space gets fresh PCID (flushing it) on the next switch */
+#define PCID_COUNT 4096
+static uint16_t pcid_next = 1;
+static uint64_t pcid_generation = 1;
 
 /* Kernel executable end virtual address */
 extern char end[];
@@ -55,6 +83,9 @@ extern char pfstacktop[], pfstack[];
 /* Allocate page within [0; BOOT_MEM_SIZE) */
 #define ALLOC_BOOTMEM 0x40000
 
+/* 2M blocks looked at by single compaction run (see compact_memory()) */
+#define COMPACT_SCAN_BUDGET 64
+
 /* Descriptor pool page size */
 #define POOL_CLASS 1
 
@@ -62,6 +93,16 @@ extern char pfstacktop[], pfstack[];
 #define LOOKUP_ALLOC    1
 #define LOOKUP_PRESERVE 0
 
+/* Ranges of page table size are shared on fork (see share_subtree()) */
+#define SHARED_CLASS 9
+/* Flags fork() maps the whole user space with: user PROT_ALL
+ * combined with copy-on-write, plus PROT_USER_ added by sys_map_region() */
+#define FORK_FLAGS (PROT_RWX | PROT_CD | PROT_USER_ | PROT_SHARE | PROT_LAZY | PROT_COMBINE)
+/* SHARED_NODE of address space the subtree was detached from */
+#define SHARED_OWNER 0x1
+/* Private mapping may be replaced by zero page once clean (see advise_region()) */
+#define MAPPING_FREE 0x1000
+
 #define PAGE_IS_FREE(p) (!(p)->refc && !(p)->left && !(p)->right)
 #define PAGE_IS_UNIQ(p) ((p)->refc == 1 && !(p)->left && !(p)->right)
 
@@ -72,14 +113,24 @@ extern char pfstacktop[], pfstack[];
 #define assert_physical(n) ({ if (trace_memory_more) _assert_root(__FILE__, __LINE__, n, 1); assert(((n)->state & NODE_TYPE_MASK) >= PARTIAL_NODE); })
 #define assert_virtual(n)  ({if (trace_memory_more) _assert_root(__FILE__, __LINE__, n, 0); assert(((n)->state & NODE_TYPE_MASK) < PARTIAL_NODE); })
 
+inline static struct List *__attribute__((always_inline))
+list_ptr(uint32_t link) {
+    return link ? (struct List *)(KERN_BASE_ADDR + (uintptr_t)link) : NULL;
+}
+
+inline static uint32_t __attribute__((always_inline))
+list_link(struct List *list) {
+    return list ? (uint32_t)((uintptr_t)list - KERN_BASE_ADDR) : 0;
+}
+
 inline static bool __attribute__((always_inline))
 list_empty(struct List *list) {
-    return list->next == list;
+    return list_ptr(list->next) == list;
 }
 
 inline static void __attribute__((always_inline))
 list_init(struct List *list) {
-    list->next = list->prev = list;
+    list->next = list->prev = list_link(list);
 }
 
 /*
@@ -92,18 +143,18 @@ list_append(struct List *list, struct List *new) {
         return;
     }
 
-    if (list->next == NULL) {
-        new->prev = list;
-        new->next = list;
-        list->next = new;
-        list->prev = new;
+    if (!list->next) {
+        new->prev = list_link(list);
+        new->next = list_link(list);
+        list->next = list_link(new);
+        list->prev = list_link(new);
         return;
     }
 
     new->next = list->next;
-    new->prev = list;
-    list->next->prev = new;
-    list->next = new;
+    new->prev = list_link(list);
+    list_ptr(list->next)->prev = list_link(new);
+    list->next = list_link(new);
 }
 
 /*
@@ -117,14 +168,56 @@ list_del(struct List *list) {
         return NULL;
     }
 
-    list->prev->next = list->next;
-    list->next->prev = list->prev;
+    list_ptr(list->prev)->next = list->next;
+    list_ptr(list->next)->prev = list->prev;
     list_init(list);
 
     return list;
 }
 
 static struct Page *alloc_page(int class, int flags);
+static bool magazine_put(struct Page *page);
+
+inline static enum FreeZone
+free_zone(struct Page *page) {
+    return page2pa(page) < BOOT_MEM_SIZE ? FREE_LOW : FREE_HIGH;
+}
+
+/* Put free block to the free list of its class and zone */
+static void
+free_list_add(struct Page *page) {
+    enum FreeZone zone = free_zone(page);
+    assert(page->class < MAX_CLASS);
+
+    list_append(&free_classes[zone][page->class], (struct List *)page);
+    free_class_mask[zone] |= 1ULL << page->class;
+    free_class_count[page->class]++;
+}
+
+/* Remove block from free list (if it is there) keeping bitmap up to date */
+static void
+free_list_del(struct Page *page) {
+    enum FreeZone zone = free_zone(page);
+    assert(page->class < MAX_CLASS);
+
+    if (list_empty((struct List *)page)) return;
+
+    list_del((struct List *)page);
+    free_class_count[page->class]--;
+    if (list_empty(&free_classes[zone][page->class]))
+        free_class_mask[zone] &= ~(1ULL << page->class);
+}
+
+/* Amount of memory in buddy allocator free lists */
+static size_t
+free_memory(void) {
+    size_t res = 0;
+    for (uint64_t mask = free_class_mask[FREE_LOW] | free_class_mask[FREE_HIGH]; mask; mask &= mask - 1) {
+        int class = __builtin_ctzll(mask);
+        res += free_class_count[class] * CLASS_SIZE(class);
+    }
+    return res;
+}
 
 void
 ensure_free_desc(size_t count) {
@@ -142,7 +235,7 @@ static struct Page *
 alloc_descriptor(enum PageState state) {
     ensure_free_desc(1);
 
-    struct Page *new = (struct Page *)list_del(free_descriptors.next);
+    struct Page *new = (struct Page *)list_del(list_ptr(free_descriptors.next));
 
     memset(new, 0, sizeof *new);
     list_init((struct List *)new);
@@ -161,7 +254,7 @@ free_descriptor(struct Page *page) {
 
 static void
 _assert_root(const char *file, int line, struct Page *p, bool phy) {
-    while (p->parent) p = p->parent;
+    while (p->parent) p = PAGE_PARENT(p);
     if ((p == &root) != phy)
         _panic(file, line, "Page %p (phy %p) should%s be physical\n", p, (void *)PADDR(p), phy ? "" : "n't");
 }
@@ -170,8 +263,9 @@ static void
 free_desc_rec(struct Page *p) {
     while (p) {
         assert(!p->refc);
-        free_desc_rec(p->right);
-        struct Page *tmp = p->left;
+        free_desc_rec(PAGE_RIGHT(p));
+        struct Page *tmp = PAGE_LEFT(p);
+        free_list_del(p);
         free_descriptor(p);
         p = tmp;
     }
@@ -206,18 +300,18 @@ alloc_child(struct Page *parent, bool right) {
     }
 
     struct Page *new = alloc_descriptor(parent->state);
-    new->left = NULL;
-    new->right = NULL;
+    new->left = 0;
+    new->right = 0;
 
     if (right) {
-        parent->right = new;
+        parent->right = page2link(new);
         new->addr = parent->addr + (1ULL << (parent->class - 1));
     } else {
-        parent->left = new;
+        parent->left = page2link(new);
         new->addr = parent->addr;
     }
 
-    new->parent = parent;
+    new->parent = page2link(parent);
     new->refc = parent->refc ? 1 : 0;
     new->class = parent->class - 1;
 
@@ -246,19 +340,19 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
 
             if (was_free) {
                 /* Recalculate free lists for allocatable page */
-                struct Page *other = !right ? node->right : node->left;
+                struct Page *other = !right ? PAGE_RIGHT(node) : PAGE_LEFT(node);
                 assert(other->state == ALLOCATABLE_NODE);
-                list_del((struct List *)node);
-                list_append(&free_classes[node->class - 1], (struct List *)other);
+                free_list_del(node);
+                free_list_add(other);
             }
 
             if (type != PARTIAL_NODE && node->state != type)
                 node->state = PARTIAL_NODE;
         }
 
-        assert((node->left && node->right) || !alloc);
+        assert((PAGE_LEFT(node) && node->right) || !alloc);
 
-        node = right ? node->right : node->left;
+        node = right ? PAGE_RIGHT(node) : PAGE_LEFT(node);
     }
 
     if (alloc) assert(node);
@@ -267,14 +361,14 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
         assert(!node->refc);
 
         /* Need to free old subtree when retyping memory */
-        free_desc_rec(node->left);
-        free_desc_rec(node->right);
-        node->left = node->right = NULL;
-        list_del((struct List *)node);
+        free_desc_rec(PAGE_LEFT(node));
+        free_desc_rec(PAGE_RIGHT(node));
+        node->left = node->right = 0;
+        free_list_del(node);
 
         /* We cannot change RESERVED_NODE memory to ALLOCATABLE_NODE */
         if (type != PARTIAL_NODE && node->state != RESERVED_NODE) node->state = type;
-        if (node->state == ALLOCATABLE_NODE) list_append(&free_classes[node->class], (struct List *)node);
+        if (node->state == ALLOCATABLE_NODE) free_list_add(node);
 
         if (trace_memory) cprintf("Attaching page (%x) at %p class=%d\n", node->state, (void *)page2pa(node), (int)node->class);
     }
@@ -292,17 +386,18 @@ page_ref(struct Page *node) {
      * all of its children are allocated too,
      * so need to reference them recursively
      * when refc transitions from 0 to 1 */
+    assert(node->refc < PAGE_REFC_MAX);
     if (!node->refc++) {
-        list_del((struct List *)node);
-        list_init((struct List *)node);
-        page_ref(node->left);
-        page_ref(node->right);
+        free_list_del(node);
+        page_ref(PAGE_LEFT(node));
+        page_ref(PAGE_RIGHT(node));
     }
 }
 
+static void page_unref(struct Page *page);
+
 static void
-page_unref(struct Page *page) {
-    if (!page) return;
+do_page_unref(struct Page *page) {
     assert_physical(page);
     assert(page->refc);
 
@@ -311,8 +406,8 @@ page_unref(struct Page *page) {
      * to prevent double frees */
 
     if (page->refc == 1) {
-        page_unref(page->left);
-        page_unref(page->right);
+        page_unref(PAGE_LEFT(page));
+        page_unref(PAGE_RIGHT(page));
     }
 
     page->refc--;
@@ -320,28 +415,30 @@ page_unref(struct Page *page) {
     /* Try to merge free page with adjacent */
     if (PAGE_IS_FREE(page)) {
         while (page != &root) {
-            struct Page *par = page->parent;
+            struct Page *par = PAGE_PARENT(page);
             assert_physical(par);
             if (par->state == page->state &&
-                PAGE_IS_FREE(par->left) &&
-                PAGE_IS_FREE(par->right)) {
-                free_descriptor(par->left);
-                par->left = NULL;
+                PAGE_IS_FREE(PAGE_LEFT(par)) &&
+                PAGE_IS_FREE(PAGE_RIGHT(par))) {
+                free_list_del(PAGE_LEFT(par));
+                free_descriptor(PAGE_LEFT(par));
+                par->left = 0;
 
-                free_descriptor(par->right);
-                par->right = NULL;
+                free_list_del(PAGE_RIGHT(par));
+                free_descriptor(PAGE_RIGHT(par));
+                par->right = 0;
 
                 if (par->state == ALLOCATABLE_NODE) {
                     assert(list_empty((struct List *)par));
-                    list_append(&free_classes[par->class], (struct List *)par);
+                    free_list_add(par);
                 }
                 page = par;
             } else
                 break;
         }
-        list_del((struct List *)page);
+        free_list_del(page);
         if (page->state == ALLOCATABLE_NODE)
-            list_append(&free_classes[page->class], (struct List *)page);
+            free_list_add(page);
 
 #if SANITIZE_SHADOW_BASE
         if (current_space) {
@@ -351,16 +448,367 @@ page_unref(struct Page *page) {
     }
 }
 
+static void
+page_unref(struct Page *page) {
+    if (!page) return;
+
+    /* Last reference to a cacheable page is taken over by the magazine */
+    if (page->refc == 1 && magazine_put(page)) return;
+
+    do_page_unref(page);
+}
+
+/*
+ * Per-CPU page magazines.
+ *
+ * Magazines cache free 4K and 2M pages in front of the buddy tree,
+ * so lazy allocation faults and frees usually don't need to split
+ * or merge tree nodes. Every cached page keeps one reference owned
+ * by the magazine, so page_unref() never merges it with its buddy.
+ */
+#define MAGAZINE_MAX 64
+
+struct PageMagazine {
+    int class;
+    size_t capacity; /* Maximal number of cached pages */
+    size_t refill;   /* Number of pages taken from the tree when empty */
+    size_t drain;    /* Number of pages left when full magazine is drained */
+
+    size_t count;
+    struct Page *pages[MAGAZINE_MAX];
+
+    size_t hits, misses, refills, drains;
+};
+
+enum {
+    MAGAZINE_4K,
+    MAGAZINE_2M,
+    MAGAZINE_COUNT,
+};
+
+static struct PageMagazine magazines[NCPU][MAGAZINE_COUNT] = {
+        [0 ... NCPU - 1] = {
+                [MAGAZINE_4K] = {.class = 0, .capacity = 64, .refill = 16, .drain = 32},
+                [MAGAZINE_2M] = {.class = MAX_ALLOCATION_CLASS, .capacity = 4, .refill = 1, .drain = 2},
+        },
+};
+
+static struct Page *alloc_buddy_page(int class, int flags);
+
+/* Set while shrinkers run, so freed pages go straight to the buddy tree */
+static bool reclaim_active;
+
+inline static struct PageMagazine *
+page_magazine(int class) {
+    if (class == 0) return &magazines[cpunum()][MAGAZINE_4K];
+    if (class == MAX_ALLOCATION_CLASS) return &magazines[cpunum()][MAGAZINE_2M];
+    return NULL;
+}
+
+/* Return cached pages to the buddy tree leaving at most keep pages */
+static size_t
+magazine_drain(struct PageMagazine *mag, size_t keep) {
+    size_t drained = 0;
+
+    if (mag->count > keep) mag->drains++;
+    while (mag->count > keep) {
+        struct Page *page = mag->pages[--mag->count];
+        assert(page->refc == 1);
+        do_page_unref(page);
+        drained++;
+    }
+
+    return drained;
+}
+
+static size_t
+magazines_drain_all(void) {
+    size_t drained = 0;
+    for (size_t cpu = 0; cpu < NCPU; cpu++)
+        for (size_t i = 0; i < MAGAZINE_COUNT; i++)
+            drained += magazine_drain(&magazines[cpu][i], 0);
+    return drained;
+}
+
+static bool
+magazine_put(struct Page *page) {
+    struct PageMagazine *mag = page_magazine(page->class);
+    if (!mag || !current_space || reclaim_active) return 0;
+    if (page->state != ALLOCATABLE_NODE || page->left || page->right) return 0;
+    /* References inherited from a parent page are not ours to keep */
+    if (page->parent && PAGE_PARENT(page)->refc) return 0;
+
+    if (mag->count == mag->capacity)
+        magazine_drain(mag, mag->drain);
+
+    /* Detach the page from its mappings list,
+     * the reference is kept by the magazine */
+    list_del((struct List *)page);
+    mag->pages[mag->count++] = page;
+
+#if SANITIZE_SHADOW_BASE
+    platform_asan_poison(KADDR(page2pa(page)), CLASS_SIZE(page->class));
+#endif
+    return 1;
+}
+
+static struct Page *
+magazine_get(struct PageMagazine *mag) {
+    if (mag->count) {
+        mag->hits++;
+    } else {
+        mag->misses++;
+        mag->refills++;
+        while (mag->count < mag->refill) {
+            struct Page *page = alloc_buddy_page(mag->class, 0);
+            if (!page) break;
+            page_ref(page);
+            mag->pages[mag->count++] = page;
+        }
+        if (!mag->count) return NULL;
+    }
+
+    struct Page *page = mag->pages[--mag->count];
+    assert(page->refc == 1 && !page->left && !page->right);
+
+    /* Return page in the same state as the buddy allocator does */
+    page->refc = 0;
+    return page;
+}
+
+/*
+ * Pools of pre-zeroed pages.
+ *
+ * Writes to memory mapped to zero_page take ready pages from here
+ * instead of allocating a page and copying zeroes into it.
+ * Pools are refilled from the idle loop with non-temporal stores,
+ * so that clearing memory does not evict useful cache lines.
+ * Pooled pages hold a reference just like magazine pages.
+ */
+#define ZERO_POOL_MAX 32
+
+struct ZeroPool {
+    int class;
+    size_t target; /* Number of pages to keep ready */
+
+    size_t count;
+    struct Page *pages[ZERO_POOL_MAX];
+    size_t backoff; /* Refills to skip after allocation failed */
+
+    size_t hits, misses, zeroed;
+};
+
+static struct ZeroPool zero_pools[] = {
+        {.class = 0, .target = ZERO_POOL_MAX},
+        {.class = MAX_ALLOCATION_CLASS, .target = 2},
+};
+
+#define ZERO_POOL_COUNT (sizeof(zero_pools) / sizeof(*zero_pools))
+
+/* Maximal amount of memory cleared on single idle loop iteration */
+#define ZERO_POOL_IDLE_BUDGET (2 * MB)
+/* Same for timer ticks, pools of larger pages are left for idle time */
+#define ZERO_POOL_TICK_BUDGET (64 * KB)
+/* Refills skipped by pool that failed to get memory,
+ * it does not keep timer ticking meanwhile */
+#define ZERO_POOL_BACKOFF 16
+
+inline static bool
+is_zero_page(struct Page *page) {
+    return page2pa(page) >= PADDR(zero_page_raw) &&
+           page2pa(page) < PADDR(zero_page_raw) + sizeof zero_page_raw;
+}
+
+static void
+clear_page_nt(struct Page *page) {
+    uint64_t *ptr = KADDR(page2pa(page));
+    uint64_t *end = ptr + CLASS_SIZE(page->class) / sizeof(*ptr);
+
+    for (; ptr < end; ptr += 4) {
+        movnti(ptr + 0, 0);
+        movnti(ptr + 1, 0);
+        movnti(ptr + 2, 0);
+        movnti(ptr + 3, 0);
+    }
+}
+
+static struct ZeroPool *
+zero_pool(int class) {
+    for (size_t i = 0; i < ZERO_POOL_COUNT; i++)
+        if (zero_pools[i].class == class) return &zero_pools[i];
+    return NULL;
+}
+
+/* Take pre-zeroed page, returned page is referenced */
+static struct Page *
+zero_pool_get(int class) {
+    struct ZeroPool *pool = zero_pool(class);
+    if (!pool) return NULL;
+
+    if (!pool->count) {
+        pool->misses++;
+        return NULL;
+    }
+
+    pool->hits++;
+    return pool->pages[--pool->count];
+}
+
+/* Clear at most budget bytes of pages for zero pools with pages
+ * not larger than budget, returns true if budget ran out before
+ * all of them were filled */
+static bool
+zero_pool_refill(size_t budget) {
+    size_t max = budget;
+    bool cleared = 0, more = 0;
+
+    for (size_t i = 0; i < ZERO_POOL_COUNT; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        if (CLASS_SIZE(pool->class) > max) continue;
+        if (pool->backoff) {
+            pool->backoff--;
+            continue;
+        }
+        while (pool->count < pool->target) {
+            if (budget < CLASS_SIZE(pool->class)) {
+                more = 1;
+                break;
+            }
+            struct Page *page = alloc_page(pool->class, 0);
+            if (!page) {
+                /* Memory is full or fragmented, retrying
+                 * right away would not help */
+                pool->backoff = ZERO_POOL_BACKOFF;
+                break;
+            }
+            page_ref(page);
+
+            clear_page_nt(page);
+            cleared = 1;
+
+            pool->pages[pool->count++] = page;
+            pool->zeroed++;
+            budget -= CLASS_SIZE(pool->class);
+        }
+    }
+
+    /* Make non-temporal stores globally visible */
+    if (cleared) sfence();
+    return more;
+}
+
+/* Some zero pool with pages not larger than max
+ * is below its target and can be refilled */
+static bool
+zero_pools_low(size_t max) {
+    for (size_t i = 0; i < ZERO_POOL_COUNT; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        if (CLASS_SIZE(pool->class) <= max && pool->count < pool->target && !pool->backoff) return 1;
+    }
+    return 0;
+}
+
+static size_t
+zero_pools_drain(void) {
+    size_t drained = 0;
+    for (size_t i = 0; i < ZERO_POOL_COUNT; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        while (pool->count) {
+            page_unref(pool->pages[--pool->count]);
+            drained++;
+        }
+    }
+    return drained;
+}
+
+/* Give memory cached by the allocator back to the buddy tree */
+static size_t
+drain_page_caches(void) {
+    size_t drained = zero_pools_drain();
+    return magazines_drain_all() + drained;
+}
+
+static void thp_collapse_idle(void);
+static void ksm_scan_idle(void);
+static bool thp_pending(void);
+static bool ksm_pending(void);
+static void compact_idle(void);
+static bool compact_memory(size_t budget, bool drain);
+static void teardown_drain(size_t budget);
+static bool teardown_pending(void);
+
+/* Tree nodes (or 1GB page table ranges) of dead
+ * address spaces freed per idle call and per timer tick */
+#define TEARDOWN_IDLE_BUDGET 512
+#define TEARDOWN_TICK_BUDGET 64
+
+/* Background memory management work done while CPU is idle.
+ * Returns true if some of the work that should not wait
+ * for long (freeing dead address spaces, filling zero pools)
+ * is left for the next call */
+bool
+pmap_idle(void) {
+    teardown_drain(TEARDOWN_IDLE_BUDGET);
+    bool more = zero_pool_refill(ZERO_POOL_IDLE_BUDGET);
+    thp_collapse_idle();
+    ksm_scan_idle();
+    compact_idle();
+    return more || teardown_pending();
+}
+
+/* There is work for pmap_idle() */
+bool
+pmap_idle_pending(void) {
+    return teardown_pending() || zero_pools_low(ZERO_POOL_IDLE_BUDGET) || thp_pending() || ksm_pending();
+}
+
+/* Small portion of background work done on timer ticks
+ * when CPU is busy: freeing dead address spaces and clearing
+ * small pages. Scanners only run while CPU is idle.
+ * Returns true if some of the work is left */
+bool
+pmap_tick(void) {
+    teardown_drain(TEARDOWN_TICK_BUDGET);
+    bool more = zero_pool_refill(ZERO_POOL_TICK_BUDGET);
+    return more || teardown_pending();
+}
+
+/* There is work for pmap_tick(), so timer should keep ticking */
+bool
+pmap_tick_pending(void) {
+    return teardown_pending() || zero_pools_low(ZERO_POOL_TICK_BUDGET);
+}
+
+void
+dump_page_caches(void) {
+    for (size_t cpu = 0; cpu < NCPU; cpu++) {
+        for (size_t i = 0; i < MAGAZINE_COUNT; i++) {
+            struct PageMagazine *mag = &magazines[cpu][i];
+            cprintf("CPU %zu magazine %lluK: %zu/%zu pages, hits=%zu misses=%zu refills=%zu drains=%zu\n",
+                    cpu, CLASS_SIZE(mag->class) / KB, mag->count, mag->capacity,
+                    mag->hits, mag->misses, mag->refills, mag->drains);
+        }
+    }
+
+    for (size_t i = 0; i < ZERO_POOL_COUNT; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        cprintf("Zero pool %lluK: %zu/%zu pages, hits=%zu misses=%zu zeroed=%zu\n",
+                CLASS_SIZE(pool->class) / KB, pool->count, pool->target,
+                pool->hits, pool->misses, pool->zeroed);
+    }
+}
+
 void
-alloc_virtual_child(struct Page *parent, struct Page **dst) {
+alloc_virtual_child(struct Page *parent, page_link_t *dst) {
     assert_virtual(parent);
-    assert(parent->phy && parent->phy->left && parent->phy->right);
-
-    if ((*dst = alloc_descriptor(parent->state))) {
-        (*dst)->parent = parent;
-        (*dst)->phy = dst == &parent->left ? parent->phy->left : parent->phy->right;
-        page_ref((*dst)->phy);
-        list_append((struct List *)(*dst)->phy, (struct List *)(*dst));
+    assert(parent->phy && PAGE_PHY(parent)->left && PAGE_PHY(parent)->right);
+
+    struct Page *child = alloc_descriptor(parent->state);
+    if ((*dst = page2link(child))) {
+        child->parent = page2link(parent);
+        child->phy = dst == &parent->left ? PAGE_PHY(parent)->left : PAGE_PHY(parent)->right;
+        page_ref(PAGE_PHY(child));
+        list_append((struct List *)PAGE_PHY(child), (struct List *)child);
     }
 }
 
@@ -385,24 +833,32 @@ alloc_virtual_child(struct Page *parent, struct Page **dst) {
  */
 static void
 check_virtual_class(struct Page *node, int class) {
-    while (node->parent) class ++, node = node->parent;
+    while (node->parent) class ++, node = PAGE_PARENT(node);
     assert(class == MAX_CLASS);
 }
 
-/* Lookup virtual address space mapping node with given address and class */
+static int unshare_subtree(struct AddressSpace *spc, struct Page *node, uintptr_t va);
+static void drop_subtree(struct AddressSpace *spc, struct Page *node);
+
+/* Lookup virtual address space mapping node with given address and class
+ * (shared subtrees on the way are made private to spc,
+ * lookups that do not change anything use page_peek_virtual()) */
 static struct Page *
-page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
+page_lookup_virtual(struct AddressSpace *spc, uintptr_t addr, int class, int alloc) {
     assert(class >= 0);
+    struct Page *node = spc->root;
     assert_virtual(node);
 
 
     int nclass = MAX_CLASS;
     while (nclass > class) {
         assert(nclass > 0);
+        if ((node->state & NODE_TYPE_MASK) == SHARED_NODE &&
+            unshare_subtree(spc, node, addr & ~CLASS_MASK(nclass)) < 0) return NULL;
         bool right = addr & CLASS_SIZE(nclass - 1);
 
 
-        struct Page **next = right ? &node->right : &node->left;
+        page_link_t *next = right ? &node->right : &node->left;
 
         if (!*next) {
             if (!alloc) break;
@@ -411,13 +867,13 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
 
             assert(nclass);
             if (node->phy) {
-                assert(nclass == node->phy->class);
+                assert(nclass == PAGE_PHY(node)->class);
                 assert((node->state & NODE_TYPE_MASK) == MAPPING_NODE);
 
-                struct Page *pleft = page_lookup(node->phy, page2pa(node->phy), node->phy->class - 1, PARTIAL_NODE, 1);
+                struct Page *pleft = page_lookup(PAGE_PHY(node), page2pa(PAGE_PHY(node)), PAGE_PHY(node)->class - 1, PARTIAL_NODE, 1);
                 if (!pleft) return NULL;
 
-                assert(node->phy->left && node->phy->right);
+                assert(PAGE_LEFT(PAGE_PHY(node)) && PAGE_RIGHT(PAGE_PHY(node)));
 
                 alloc_virtual_child(node, &node->left);
                 if (!node->left) return NULL;
@@ -425,17 +881,17 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
                 if (!node->right) return NULL;
 
                 list_del((struct List *)node);
-                page_unref(node->phy);
-                node->phy = NULL;
+                page_unref(PAGE_PHY(node));
+                node->phy = 0;
                 node->state = INTERMEDIATE_NODE;
             } else {
                 assert(node->state == INTERMEDIATE_NODE);
-                *next = alloc_descriptor(INTERMEDIATE_NODE);
-                (*next)->parent = node;
+                *next = page2link(alloc_descriptor(INTERMEDIATE_NODE));
+                link2page(*next)->parent = page2link(node);
             }
             assert(*next);
         }
-        node = *next;
+        node = link2page(*next);
         nclass--;
     }
 
@@ -446,6 +902,31 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
     return node;
 }
 
+/* Same as page_lookup_virtual() with LOOKUP_PRESERVE, but shared
+ * subtrees are looked into instead of being made private, so the
+ * tree is not changed. Returned node must not be modified. Number of
+ * address spaces that use the mapping through the same shared
+ * subtree is stored to nshared */
+static struct Page *
+page_peek_virtual(struct AddressSpace *spc, uintptr_t addr, int class, int *nshared) {
+    struct Page *node = spc->root;
+    *nshared = 1;
+
+    for (int nclass = MAX_CLASS; nclass > class; nclass--) {
+        if ((node->state & NODE_TYPE_MASK) == SHARED_NODE) {
+            struct Page *holder = link2page(node->subtree);
+            *nshared = holder->refc;
+            node = PAGE_LEFT(holder);
+        }
+
+        page_link_t next = addr & CLASS_SIZE(nclass - 1) ? node->right : node->left;
+        if (!next) break;
+        node = link2page(next);
+    }
+
+    return node;
+}
+
 static void
 attach_region(uintptr_t start, uintptr_t end, enum PageState type) {
     if (trace_memory_more)
@@ -489,25 +970,40 @@ attach_region(uintptr_t start, uintptr_t end, enum PageState type) {
     }
 }
 
+/* Account mapping node in address space statistics
+ * (detached subtrees have no address space) */
+inline static void
+mapping_account(struct AddressSpace *spc, struct Page *node, int sign) {
+    if (!spc) return;
+    size_t size = CLASS_SIZE(PAGE_PHY(node)->class);
+    spc->resident += sign * size;
+    if (node->state & (PROT_SHARE | PROT_LAZY))
+        spc->shared += sign * size;
+}
+
 static void
-unmap_page_remove(struct Page *node) {
+unmap_page_remove(struct AddressSpace *spc, struct Page *node) {
     if (!node) return;
     assert_virtual(node);
 
     if (node->phy) {
         assert(!node->left && !node->right);
         assert((node->state & NODE_TYPE_MASK) == MAPPING_NODE);
-        page_unref(node->phy);
+        mapping_account(spc, node, -1);
+        page_unref(PAGE_PHY(node));
+    } else if ((node->state & NODE_TYPE_MASK) == SHARED_NODE) {
+        assert(!node->left && !node->right);
+        drop_subtree(spc, node);
     } else {
         assert((node->state & NODE_TYPE_MASK) == INTERMEDIATE_NODE);
-        unmap_page_remove(node->left);
-        unmap_page_remove(node->right);
+        unmap_page_remove(spc, PAGE_LEFT(node));
+        unmap_page_remove(spc, PAGE_RIGHT(node));
     }
 
     if (node->parent) {
-        *(node->parent->left == node ?
-                  &node->parent->left :
-                  &node->parent->right) = NULL;
+        *(PAGE_LEFT(PAGE_PARENT(node)) == node ?
+                  &PAGE_PARENT(node)->left :
+                  &PAGE_PARENT(node)->right) = 0;
     }
 
     free_descriptor(node);
@@ -522,8 +1018,10 @@ remove_pt(pte_t *pt, pte_t base, size_t step, uintptr_t i0, uintptr_t i1) {
 
         if (!(pt[i] & PTE_PS) && step > 4 * KB) {
             pte_t *pt2 = KADDR(PTE_ADDR(pt[i]));
-            remove_pt(pt2, base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
-            page_unref(page_lookup(NULL, (uintptr_t)PADDR(pt2), 0, PARTIAL_NODE, 0));
+            struct Page *page = page_lookup(NULL, (uintptr_t)PADDR(pt2), 0, PARTIAL_NODE, 0);
+            /* Page table shared on fork is still used by others */
+            if (page->refc == 1) remove_pt(pt2, base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
+            page_unref(page);
         }
 
         pt[i] = 0;
@@ -575,47 +1073,47 @@ check_physical_tree(struct Page *page) {
     assert(page->class >= 0);
     assert(!(page2pa(page) & CLASS_MASK(page->class)));
     if (page->state == ALLOCATABLE_NODE || page->state == RESERVED_NODE) {
-        if (page->left) assert(page->left->state == page->state);
-        if (page->right) assert(page->right->state == page->state);
+        if (page->left) assert(PAGE_LEFT(page)->state == page->state);
+        if (page->right) assert(PAGE_RIGHT(page)->state == page->state);
     }
     if (page->left) {
-        assert(page->left->class + 1 == page->class);
-        assert(page2pa(page) == page2pa(page->left));
+        assert(PAGE_LEFT(page)->class + 1 == page->class);
+        assert(page2pa(page) == page2pa(PAGE_LEFT(page)));
     }
     if (page->right) {
-        assert(page->right->class + 1 == page->class);
-        assert(page->addr + (1ULL << (page->class - 1)) == page->right->addr);
+        assert(PAGE_RIGHT(page)->class + 1 == page->class);
+        assert(page->addr + (1ULL << (page->class - 1)) == PAGE_RIGHT(page)->addr);
     }
     if (page->parent) {
-        assert(page->parent->class - 1 == page->class);
-        assert((page->parent->left == page) ^ (page->parent->right == page));
+        assert(PAGE_PARENT(page)->class - 1 == page->class);
+        assert((PAGE_LEFT(PAGE_PARENT(page)) == page) ^ (PAGE_RIGHT(PAGE_PARENT(page)) == page));
     } else {
-        assert(page->class == MAX_CLASS);
+        assert(page->class == MAX_PHYS_CLASS);
         assert(page == &root);
     }
     if (!page->refc) {
         assert(page->head.next && page->head.prev);
         if (!list_empty((struct List *)page)) {
-            for (struct List *n = page->head.next;
-                 n != &free_classes[page->class]; n = n->next) {
+            for (struct List *n = list_ptr(page->head.next);
+                 n != &free_classes[free_zone(page)][page->class]; n = list_ptr(n->next)) {
                 assert(n != &page->head);
             }
         }
     } else {
-        for (struct List *n = (struct List *)page->head.next;
-             (struct List *)page != n; n = n->next) {
+        for (struct List *n = list_ptr(page->head.next);
+             (struct List *)page != n; n = list_ptr(n->next)) {
             struct Page *v = (struct Page *)n;
             assert_virtual(v);
-            assert(v->phy == page);
+            assert(PAGE_PHY(v) == page);
         }
     }
     if (page->left) {
-        assert(page->left->parent == page);
-        check_physical_tree(page->left);
+        assert(PAGE_PARENT(PAGE_LEFT(page)) == page);
+        check_physical_tree(PAGE_LEFT(page));
     }
     if (page->right) {
-        assert(page->right->parent == page);
-        check_physical_tree(page->right);
+        assert(PAGE_PARENT(PAGE_RIGHT(page)) == page);
+        check_physical_tree(PAGE_RIGHT(page));
     }
 }
 
@@ -628,19 +1126,24 @@ check_virtual_tree(struct Page *page, int class) {
         assert(!(page->state & PROT_LAZY) || !(page->state & PROT_SHARE));
         assert(!page->left && !page->right);
         assert(page->phy);
-        if (!(page->phy->class == class)) cprintf("%d %d\n", page->phy->class, class);
-        assert(page->phy->class == class);
+        if (!(PAGE_PHY(page)->class == class)) cprintf("%d %d\n", PAGE_PHY(page)->class, class);
+        assert(PAGE_PHY(page)->class == class);
+    } else if ((page->state & NODE_TYPE_MASK) == SHARED_NODE) {
+        assert(class == SHARED_CLASS);
+        assert(!page->phy && page->subtree);
+        assert(!page->left && !page->right);
+        assert(link2page(page->subtree)->refc);
     } else {
         assert(!page->phy);
         assert(page->state == INTERMEDIATE_NODE);
     }
     if (page->left) {
-        assert(page->left->parent == page);
-        check_virtual_tree(page->left, class - 1);
+        assert(PAGE_PARENT(PAGE_LEFT(page)) == page);
+        check_virtual_tree(PAGE_LEFT(page), class - 1);
     }
     if (page->right) {
-        assert(page->right->parent == page);
-        check_virtual_tree(page->right, class - 1);
+        assert(PAGE_PARENT(PAGE_RIGHT(page)) == page);
+        check_virtual_tree(PAGE_RIGHT(page), class - 1);
     }
 }
 
@@ -653,17 +1156,29 @@ dump_virtual_tree(struct Page *node, int class) {
     if ((node->state & NODE_TYPE_MASK) == MAPPING_NODE ||
             (node->state & NODE_TYPE_MASK) == INTERMEDIATE_NODE) {
         cprintf("PA: 0x%016lx, Size: 0x%llx, refc=%d, phy=%p\n",
-            page2pa(node), CLASS_SIZE(node->class), node->refc, node->phy
+            page2pa(node), CLASS_SIZE(node->class), node->refc, PAGE_PHY(node)
         );
     }
 
     if (node->left) {
-        dump_virtual_tree(node->left, class - 1);
+        dump_virtual_tree(PAGE_LEFT(node), class - 1);
     }
 
     if (node->right) {
-        dump_virtual_tree(node->right, class - 1);
+        dump_virtual_tree(PAGE_RIGHT(node), class - 1);
+    }
+}
+
+/* Total number of page descriptors, including free ones */
+static size_t
+count_descriptors(size_t *npools) {
+    size_t ndesc = INIT_DESCR;
+    *npools = 0;
+    for (struct PagePool *pool = first_pool; pool; pool = pool->next) {
+        ++*npools;
+        ndesc += POOL_ENTRIES_FOR_SIZE(CLASS_SIZE(pool->peer->class));
     }
+    return ndesc;
 }
 
 void
@@ -672,21 +1187,31 @@ dump_memory_lists(void) {
     for (int i = 0; i < MAX_CLASS; ++i) {
         cprintf("Start of class %d\n", i);
 
-        struct Page *page = (void *)free_classes[i].next;
-        if (list_empty(&page->head)) {
+        if (!(free_class_mask[FREE_LOW] & (1ULL << i)) &&
+            !(free_class_mask[FREE_HIGH] & (1ULL << i))) {
             cprintf("No pages of class %d\n", i);
             continue;
         }
 
-        while (page != (void *)&free_classes[i]) {
-            cprintf("page addr: 0x%08lx, class size: 0x%llx, phy=%p\n",
-                (uintptr_t)page->addr << CLASS_BASE,
-                CLASS_SIZE(page->class),
-                page->phy
-            );
-            page = (void *)page->head.next;
+        for (int zone = 0; zone < FREE_NZONES; zone++) {
+            struct Page *page = (void *)list_ptr(free_classes[zone][i].next);
+            while (page != (void *)&free_classes[zone][i]) {
+                cprintf("page addr: 0x%08lx, class size: 0x%llx, phy=%p\n",
+                    (uintptr_t)page->addr << CLASS_BASE,
+                    CLASS_SIZE(page->class),
+                    PAGE_PHY(page)
+                );
+                page = (void *)list_ptr(page->head.next);
+            }
         }
     }
+
+    size_t npools = 0, ndesc = count_descriptors(&npools);
+    cprintf("Descriptors: %zu bytes each, %zu per pool, %zu pools + %d initial\n",
+            sizeof(struct Page), (size_t)POOL_ENTRIES_FOR_SIZE(CLASS_SIZE(POOL_CLASS)), npools, INIT_DESCR);
+    cprintf("Descriptors: %zu total, %zu used, %zu free, %zuK of metadata\n",
+            ndesc, ndesc - free_desc_count, free_desc_count,
+            (size_t)((npools * CLASS_SIZE(POOL_CLASS) + INIT_DESCR * sizeof(struct Page)) / KB));
 }
 
 /*
@@ -755,35 +1280,48 @@ alloc_pt(pte_t *dst) {
     return 0;
 }
 
+/*
+ * Kernel half of every address space.
+ *
+ * Each kernel PML4 slot is backed by a PDPT allocated once in init_kspace()
+ * and never freed, so kernel mappings only change lower levels, which are
+ * shared by all address spaces. Address space creation copies the upper half
+ * of kspace PML4 without touching refcounts and teardown ignores it.
+ * If kspace PML4 entries still change (e.g. a >= 512GB kernel mapping is
+ * removed) kernel_pml4_gen is bumped and other spaces resync lazily
+ * when switched to.
+ */
+static uint64_t kernel_pml4_gen = 1;
+
 static void
-propagate_one_pml4(struct AddressSpace *dst, struct AddressSpace *src) {
-    /* Reference level 3 page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (src->pml4[i] & PTE_P && i != PML4_INDEX(UVPT))
-            page_ref(page_lookup(NULL, PTE_ADDR(src->pml4[i]), 0, PARTIAL_NODE, 0));
-    }
+copy_kernel_pml4(struct AddressSpace *space) {
+    pte_t uvpt = space->pml4[PML4_INDEX(UVPT)];
+    memcpy(space->pml4 + NUSERPML4, kspace.pml4 + NUSERPML4,
+           PAGE_SIZE - NUSERPML4 * sizeof(pml4e_t));
+    space->pml4[PML4_INDEX(UVPT)] = uvpt;
+    space->pml4_gen = kernel_pml4_gen;
+}
 
-    /* Dereference old level 3 page tables */
+static int
+share_kernel_pml4(void) {
     for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (dst->pml4[i] & PTE_P && i != PML4_INDEX(UVPT))
-            page_unref(page_lookup(NULL, PTE_ADDR(dst->pml4[i]), 0, PARTIAL_NODE, 0));
+        if (i == PML4_INDEX(UVPT) || kspace.pml4[i] & PTE_P) continue;
+        int res = alloc_pt(kspace.pml4 + i);
+        if (res < 0) return res;
     }
-
-    pte_t uvpt = dst->pml4[PML4_INDEX(UVPT)];
-    memcpy(dst->pml4 + NUSERPML4, src->pml4 + NUSERPML4,
-           PAGE_SIZE - NUSERPML4 * sizeof(pml4e_t));
-    dst->pml4[PML4_INDEX(UVPT)] = uvpt;
+    return 0;
 }
 
 static void
-propagate_pml4(struct AddressSpace *spc) {
-    if (!current_space) return;
-
-    if (spc != &kspace) propagate_one_pml4(&kspace, spc);
-    for (size_t i = 0; i < NENV; i++) {
-        if (envs[i].env_status != ENV_FREE && &envs[i].address_space != spc)
-            propagate_one_pml4(&envs[i].address_space, spc);
-    }
+kernel_pml4_changed(struct AddressSpace *spc) {
+    assert(spc == &kspace);
+    if (share_kernel_pml4() < 0)
+        panic("Out of memory for kernel PDPTs");
+    kernel_pml4_gen++;
+
+    /* Current space might be used for kernel accesses right away */
+    if (current_space && current_space != &kspace)
+        copy_kernel_pml4(current_space);
 }
 
 inline static int
@@ -820,46 +1358,227 @@ alloc_fill_pt(pte_t *dst, pte_t base, size_t step, size_t i0, size_t i1) {
 
 /* Copy physical page contents to some virtual address
  *
- * To copy physical address you can use linear
- * physical memory mapping to KERN_BASE_ADDR
- * (via KADDR).
- *
- * You need temporarily switch to dst address space and
- * restore previous address space afterwards.
- *
- * Don't forget to disable write protection, since
- * destination page might be read-only
+ * Destination memory might consist of several
+ * physical pages (see alloc_composite_page()), so every
+ * one of them is looked up in the virtual tree and
+ * written through the linear physical memory mapping
+ * at KERN_BASE_ADDR (via KADDR).
  *
- * TIP: switch_address_space, nosan_memcpy, and set_wp are used here
+ * This does not need to switch to dst address space
+ * or to disable write protection.
  */
 static void
 memcpy_page(struct AddressSpace *dst, uintptr_t va, struct Page *page) {
-    assert(current_space);
     assert(dst);
 
-    // LAB 7: Your code here
-    struct AddressSpace *old = switch_address_space(dst);
-    set_wp(false);
-    nosan_memcpy((void *)va, KADDR(page2pa(page)), CLASS_SIZE(page->class));
-    set_wp(true);
-    switch_address_space(old);
+    uintptr_t end = va + CLASS_SIZE(page->class);
+    physaddr_t src = page2pa(page);
+
+    while (va < end) {
+        struct Page *node = page_lookup_virtual(dst, va, 0, LOOKUP_PRESERVE);
+        assert(node && node->phy);
+        assert(!(va & CLASS_MASK(PAGE_PHY(node)->class)));
+
+        size_t size = CLASS_SIZE(PAGE_PHY(node)->class);
+        nosan_memcpy(KADDR(page2pa(PAGE_PHY(node))), KADDR(src), size);
+        va += size;
+        src += size;
+    }
 }
 
+/* Same as memcpy_page() but fills memory with value */
 static void
-tlb_invalidate_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
-    if (current_space == spc || !current_space) {
-        /* If we need to invalidate a lot of memory, just flush whole cache */
-        if (start - end > 512 * GB)
+memset_page(struct AddressSpace *dst, uintptr_t va, int value, size_t size) {
+    assert(dst);
+
+    uintptr_t end = va + size;
+    while (va < end) {
+        struct Page *node = page_lookup_virtual(dst, va, 0, LOOKUP_PRESERVE);
+        assert(node && node->phy);
+        assert(!(va & CLASS_MASK(PAGE_PHY(node)->class)));
+
+        nosan_memset(KADDR(page2pa(PAGE_PHY(node))), value, CLASS_SIZE(PAGE_PHY(node)->class));
+        va += CLASS_SIZE(PAGE_PHY(node)->class);
+    }
+}
+
+/* Flushing whole PCID (or TLB) is cheaper than
+ * invalidating more than this number of pages one by one */
+#define TLB_FLUSH_CEILING 33
+
+/* Invalidations are deferred while batch is open and
+ * issued once it is closed by outermost tlb_batch_end() */
+#define TLB_BATCH_SPACES 2
+#define TLB_BATCH_RANGES 8
+
+struct TlbBatch {
+    struct AddressSpace *space;
+    size_t pages;   /* Total size of deferred ranges */
+    size_t nranges; /* > TLB_BATCH_RANGES if whole space needs flushing */
+    struct {
+        uintptr_t start, end;
+    } ranges[TLB_BATCH_RANGES];
+};
+
+static int tlb_batch_depth;
+static struct TlbBatch tlb_batches[TLB_BATCH_SPACES];
+
+static struct {
+    size_t invlpg;       /* Single page invalidations of current space */
+    size_t invpcid;      /* Single page invalidations of inactive spaces */
+    size_t pcid_flushes; /* Whole address space flushes */
+    size_t full_flushes; /* Flushes of every address space */
+    size_t deferred;     /* Ranges accumulated into batches */
+    size_t batches;      /* Non-empty batches flushed */
+} tlb_stats;
+
+static void
+tlb_flush_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
+    bool whole = end - start > TLB_FLUSH_CEILING * PAGE_SIZE;
+
+    if (pcid_enabled && spc == &kspace) {
+        /* Kernel part of address space is shared between all
+         * address spaces, so it can be cached under any PCID */
+        if (has_invpcid) {
+            invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+            tlb_stats.full_flushes++;
+            return;
+        }
+        /* Make every user address space flush its PCID on next switch */
+        pcid_generation++;
+    } else if (pcid_enabled && current_space != spc) {
+        /* Stale entries of inactive address space survive
+         * switches now, drop them or its whole PCID */
+        if (spc->pcid_gen != pcid_generation) return;
+        if (!has_invpcid) {
+            spc->pcid_gen = 0;
+            tlb_stats.pcid_flushes++;
+        } else if (whole) {
+            invpcid(INVPCID_CONTEXT, spc->pcid, 0);
+            tlb_stats.pcid_flushes++;
+        } else {
+            for (; start < end; start += PAGE_SIZE) {
+                invpcid(INVPCID_ADDR, spc->pcid, start);
+                tlb_stats.invpcid++;
+            }
+        }
+        return;
+    }
+
+    /* Kernel part of address space is shared
+     * between all address spaces */
+    if (current_space == spc || !current_space || spc == &kspace) {
+        /* If we need to invalidate a lot of memory, just flush whole cache
+         * (with PCIDs enabled this only flushes current PCID) */
+        if (whole) {
             lcr3(rcr3());
-        else {
+            if (pcid_enabled && spc != &kspace)
+                tlb_stats.pcid_flushes++;
+            else
+                tlb_stats.full_flushes++;
+        } else {
             while (start < end) {
                 invlpg((void *)start);
                 start += PAGE_SIZE;
+                tlb_stats.invlpg++;
             }
         }
     }
 }
 
+static void
+tlb_invalidate_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
+    /* Kernel mappings are never deferred since
+     * kernel itself might touch them right away */
+    if (!tlb_batch_depth || spc == &kspace) {
+        tlb_flush_range(spc, start, end);
+        return;
+    }
+
+    struct TlbBatch *batch = NULL;
+    for (size_t i = 0; i < TLB_BATCH_SPACES; i++) {
+        if (tlb_batches[i].space == spc) {
+            batch = &tlb_batches[i];
+            break;
+        }
+        if (!tlb_batches[i].space && !batch) batch = &tlb_batches[i];
+    }
+    if (!batch) {
+        tlb_flush_range(spc, start, end);
+        return;
+    }
+
+    batch->space = spc;
+    batch->pages += (end - start) / PAGE_SIZE;
+    tlb_stats.deferred++;
+    if (batch->nranges > TLB_BATCH_RANGES) return;
+
+    if (batch->pages > TLB_FLUSH_CEILING) {
+        batch->nranges = TLB_BATCH_RANGES + 1;
+        return;
+    }
+
+    /* Merge adjacent ranges, they are typically produced in order */
+    if (batch->nranges) {
+        typeof(batch->ranges[0]) *last = &batch->ranges[batch->nranges - 1];
+        if (start <= last->end && end >= last->start) {
+            last->start = MIN(last->start, start);
+            last->end = MAX(last->end, end);
+            return;
+        }
+    }
+
+    if (batch->nranges == TLB_BATCH_RANGES) {
+        batch->nranges++;
+    } else {
+        batch->ranges[batch->nranges].start = start;
+        batch->ranges[batch->nranges].end = end;
+        batch->nranges++;
+    }
+}
+
+static void
+tlb_batch_begin(void) {
+    tlb_batch_depth++;
+}
+
+/* Issue deferred invalidations right away, even if batch is still open
+ * (required before freed pages can be handed out again) */
+static void
+tlb_batch_flush(void) {
+    for (size_t i = 0; i < TLB_BATCH_SPACES; i++) {
+        struct TlbBatch *batch = &tlb_batches[i];
+        if (!batch->space) continue;
+
+        if (batch->nranges > TLB_BATCH_RANGES) {
+            tlb_flush_range(batch->space, 0, MAX_USER_ADDRESS);
+        } else {
+            for (size_t j = 0; j < batch->nranges; j++)
+                tlb_flush_range(batch->space, batch->ranges[j].start, batch->ranges[j].end);
+        }
+
+        batch->space = NULL;
+        batch->pages = batch->nranges = 0;
+        tlb_stats.batches++;
+    }
+}
+
+static void
+tlb_batch_end(void) {
+    assert(tlb_batch_depth > 0);
+    if (!--tlb_batch_depth) tlb_batch_flush();
+}
+
+void
+dump_tlb_stats(void) {
+    cprintf("TLB: invlpg=%zu invpcid=%zu pcid_flushes=%zu full_flushes=%zu deferred=%zu batches=%zu\n",
+            tlb_stats.invlpg, tlb_stats.invpcid, tlb_stats.pcid_flushes,
+            tlb_stats.full_flushes, tlb_stats.deferred, tlb_stats.batches);
+    cprintf("TLB: PCID %s, INVPCID %s, flush ceiling %d pages\n",
+            pcid_enabled ? "enabled" : "disabled", has_invpcid ? "supported" : "not supported",
+            TLB_FLUSH_CEILING);
+}
+
 static void
 unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     if (trace_memory) cprintf("<%p> Unmapping [%08lX, %08lX]\n",
@@ -867,8 +1586,8 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     int res;
     assert(!(addr & CLASS_MASK(class)));
 
-    struct Page *node = page_lookup_virtual(spc->root, addr, class, LOOKUP_ALLOC);
-    if (node) unmap_page_remove(node);
+    struct Page *node = page_lookup_virtual(spc, addr, class, LOOKUP_ALLOC);
+    if (node) unmap_page_remove(spc, node);
     /* Disallow root node deallocation */
     if (node == spc->root)
         spc->root = alloc_descriptor(INTERMEDIATE_NODE);
@@ -879,7 +1598,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     size_t pml4i0 = PML4_INDEX(addr), pml4i1 = PML4_INDEX(end);
     if (class >= 27) {
         remove_pt(spc->pml4, addr, 512 * GB, pml4i0, pml4i1);
-        if (pml4i1 - 1 >= NUSERPML4) propagate_pml4(spc);
+        if (spc == &kspace) kernel_pml4_changed(spc);
         goto finish;
     }
 
@@ -993,12 +1712,13 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
     if (!(flags & ALLOC_WEAK)) {
         page_ref(page);
         unmap_page(spc, addr, page->class);
-        struct Page *mapping = page_lookup_virtual(spc->root, addr, page->class, LOOKUP_ALLOC);
+        struct Page *mapping = page_lookup_virtual(spc, addr, page->class, LOOKUP_ALLOC);
         if (!mapping) return -E_NO_MEM;
 
-        mapping->phy = page;
+        mapping->phy = page2link(page);
         mapping->state = (PAGE_PROT(flags) & ~PROT_COMBINE) | MAPPING_NODE;
         list_append((struct List *)page, (struct List *)mapping);
+        mapping_account(spc, mapping, 1);
     }
 
     if (trace_memory) cprintf("<%p> Mapping [%08lX, %08lX] to [%08lX, %08lX] (class=%d flags=%x)\n", spc,
@@ -1015,19 +1735,18 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
     /* Fill PML4 range if page size is larger than 512GB */
     if (page->class >= 27) {
         int res = alloc_fill_pt(spc->pml4, base, 512 * GB, pml4i0, pml4i1);
-        if (pml4i1 - 1 >= NUSERPML4)
-            propagate_pml4(spc);
+        if (spc == &kspace)
+            kernel_pml4_changed(spc);
 
         return res;
     }
 
-    /* Allocate empty pdp if required */
+    /* Allocate empty pdp if required
+     * (kernel ones are always present) */
     if (!(spc->pml4[pml4i0] & PTE_P)) {
+        assert(pml4i0 < NUSERPML4);
         if (alloc_pt(spc->pml4 + pml4i0) < 0)
             return -E_NO_MEM;
-
-        if (pml4i0 >= NUSERPML4)
-            propagate_pml4(spc);
     }
     assert(!(spc->pml4[pml4i0] & PTE_PS)); /* There's (yet) no support for 512GB pages in x86 arch */
     pdpe_t *pdp = KADDR(PTE_ADDR(spc->pml4[pml4i0]));
@@ -1125,6 +1844,8 @@ unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size) {
     uintptr_t start = ROUNDDOWN(dst, 1ULL << CLASS_BASE);
     uintptr_t end = ROUNDUP(dst + size, 1ULL << CLASS_BASE);
 
+    tlb_batch_begin();
+
     for (; class < MAX_CLASS && start + CLASS_SIZE(class) <= end; class ++) {
         if (start & CLASS_SIZE(class)) {
             unmap_page(dspace, start, class);
@@ -1138,33 +1859,62 @@ unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size) {
             start += CLASS_SIZE(class);
         }
     }
+
+    tlb_batch_end();
 }
 
 /* Just allocate page, without mapping it */
 static struct Page *
 alloc_page(int class, int flags) {
-    struct List *li = NULL;
-    struct Page *peer = NULL;
-
+    /* Descriptors are linked with 32-bit offsets,
+     * so pools always have to be in boot memory */
     if (flags & ALLOC_POOL) flags |= ALLOC_BOOTMEM;
 #ifndef SANITIZE_SHADOW_BASE
-    if (current_space) flags &= ~ALLOC_BOOTMEM;
+    else if (current_space) flags &= ~ALLOC_BOOTMEM;
 #endif
 
-    /* Find page that is not smaller than requested
-     * (Pool memory should also be within BOOT_MEM_SIZE) */
-    for (int pclass = class; pclass < MAX_CLASS; pclass++, li = NULL) {
-        for (li = free_classes[pclass].next; li != &free_classes[pclass]; li = li->next) {
-            peer = (struct Page *)li;
-            assert(peer->state == ALLOCATABLE_NODE);
-            assert_physical(peer);
-            if (!(flags & ALLOC_BOOTMEM) || page2pa(peer) + CLASS_SIZE(class) < BOOT_MEM_SIZE) goto found;
-        }
+    struct Page *page = NULL;
+    struct PageMagazine *mag = page_magazine(class);
+    if (mag && current_space && !(flags & (ALLOC_POOL | ALLOC_BOOTMEM)))
+        page = magazine_get(mag);
+
+    if (!page) page = alloc_buddy_page(class, flags);
+    /* Cached pages might be enough to satisfy request after merging */
+    if (!page && !(flags & ALLOC_POOL) && drain_page_caches())
+        page = alloc_buddy_page(class, flags);
+    /* So might be memory of dead address spaces */
+    if (!page && !(flags & ALLOC_POOL) && teardown_pending()) {
+        teardown_drain(0);
+        page = alloc_buddy_page(class, flags);
     }
-    return NULL;
 
-found:
-    list_del(li);
+    return page;
+}
+
+/* Allocate page directly from the buddy tree */
+static struct Page *
+alloc_buddy_page(int class, int flags) {
+    struct Page *peer = NULL;
+
+    /* Find the smallest non-empty class that is not smaller than requested
+     * (Pool memory should also be within BOOT_MEM_SIZE) */
+    uint64_t mask = free_class_mask[FREE_LOW];
+    if (!(flags & ALLOC_BOOTMEM)) mask |= free_class_mask[FREE_HIGH];
+    mask &= ~((1ULL << class) - 1);
+    if (!mask) return NULL;
+
+    int pclass = __builtin_ctzll(mask);
+    /* Keep boot memory for allocations that cannot live anywhere else */
+    enum FreeZone zone = FREE_LOW;
+    if (!(flags & ALLOC_BOOTMEM) && free_class_mask[FREE_HIGH] & (1ULL << pclass))
+        zone = FREE_HIGH;
+
+    peer = (struct Page *)list_ptr(free_classes[zone][pclass].next);
+    assert(peer->state == ALLOCATABLE_NODE);
+    assert_physical(peer);
+    assert(!(flags & ALLOC_BOOTMEM) || page2pa(peer) + CLASS_SIZE(class) <= BOOT_MEM_SIZE);
+
+    free_list_del(peer);
 
     size_t ndesc = 0;
     static bool allocating_pool;
@@ -1214,10 +1964,13 @@ region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size) {
     uintptr_t end = ROUNDUP(addr + size, PAGE_SIZE);
     int res = 0;
     while (start < end) {
-        struct Page *page = page_lookup_virtual(spc->root, start, 0, LOOKUP_PRESERVE);
+        int nshared;
+        struct Page *page = page_peek_virtual(spc, start, 0, &nshared);
         if (page && page->phy) {
-            res = MAX(res, page->phy->refc + (page->phy->left || page->phy->right));
-            start += CLASS_SIZE(page->phy->class);
+            /* Mapping in a shared subtree stands for one per space */
+            res = MAX(res, PAGE_PHY(page)->refc + nshared - 1 +
+                                   (PAGE_LEFT(PAGE_PHY(page)) || PAGE_RIGHT(PAGE_PHY(page))));
+            start += CLASS_SIZE(PAGE_PHY(page)->class);
         } else
             start += CLASS_SIZE(0);
     }
@@ -1292,6 +2045,9 @@ alloc_composite_page(struct AddressSpace *spc, uintptr_t addr, int class, int fl
     assert(!(addr & CLASS_MASK(class)));
 
     struct Page *page = alloc_page(class, flags);
+    /* Moving small pages away might free 2M block */
+    if (!page && class == MAX_ALLOCATION_CLASS && compact_memory(COMPACT_SCAN_BUDGET, 1))
+        page = alloc_page(class, flags);
     if (page) {
         res = map_page(spc, addr, page, flags);
     } else if (class) {
@@ -1305,64 +2061,407 @@ alloc_composite_page(struct AddressSpace *spc, uintptr_t addr, int class, int fl
     return res;
 }
 
-int
-force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
-    int res = -E_FAULT;
-    /* FIXME We need to propagate kernel PML4E
-     * changes to every AddressSpace or just use KPTI
-     * (now it's ok since kernel does not map huge chunks of memory (>= 512GB)
-     * to higher part of address space after initialization) */
+/* Number of times allocation on page fault
+ * is retried after reclaiming memory */
+#define RECLAIM_RETRIES 3
 
-    static_assert(!(MAX_USER_ADDRESS & (HUGE_PAGE_SIZE * 512 * 512 - 1)), "MAX_USER_ADDRESS should be aligned on 512GiB");
+/* Page fault statistics */
+static struct {
+    size_t cow[MEMSTAT_FAULT_CLASSES];
+    size_t zero[MEMSTAT_FAULT_CLASSES];
+    size_t reuse[MEMSTAT_FAULT_CLASSES];
+    size_t oom;
+} fault_stats;
 
-    /* If we are working with kernel addresses
-     * kspace should be current */
-    struct AddressSpace *old = NULL;
-    assert(current_space);
-    old = switch_address_space(spc = (va > MAX_USER_ADDRESS ? &kspace : spc));
+inline static int
+fault_class(struct Page *page) {
+    return MIN((int)page->class, MEMSTAT_FAULT_CLASSES - 1);
+}
+
+/* Resolve lazy (copy-on-write or zero-filled) mapping at va */
+static int
+resolve_lazy_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
+    int res = -E_FAULT;
 
+    /* Range shared on fork is made private first, which
+     * might be all that is needed to resolve the fault */
+    struct Page *page = page_lookup_virtual(spc, va, SHARED_CLASS, LOOKUP_PRESERVE);
+    bool unshared = page && (page->state & NODE_TYPE_MASK) == SHARED_NODE;
+    if (unshared && (res = unshare_subtree(spc, page, va & ~CLASS_MASK(SHARED_CLASS))) < 0) return res;
+    res = -E_FAULT;
 
     /* Lookup page mapping such that it's class it not larger than MAX_ALLOCATION_CLASS */
-    struct Page *page;
-    if (!(page = page_lookup_virtual(spc->root, va, maxclass, LOOKUP_SPLIT))) goto fault;
-    if (!(page = page_lookup_virtual(spc->root, va, 0, LOOKUP_PRESERVE))) goto fault;
-    if (!(page->state & PROT_LAZY)) goto fault;
+    if (!(page = page_lookup_virtual(spc, va, maxclass, LOOKUP_SPLIT))) return res;
+    if (!(page = page_lookup_virtual(spc, va, 0, LOOKUP_PRESERVE))) return res;
+    if (!(page->state & PROT_LAZY)) return unshared ? 0 : res;
 
-    va &= ~CLASS_MASK(page->phy->class);
+    va &= ~CLASS_MASK(PAGE_PHY(page)->class);
 
-    if (PAGE_IS_UNIQ(page->phy)) {
+    struct Page *zpage = NULL;
+    if (PAGE_IS_UNIQ(PAGE_PHY(page))) {
         /* If we have the only reference to the page and
          * and its mapping to itself we can actually just
          * disable lazy flag and not bother copying */
-        res = map_page(spc, va, page->phy, page->state & ~PROT_LAZY);
+        res = map_page(spc, va, PAGE_PHY(page), page->state & ~PROT_LAZY);
+        if (!res) fault_stats.reuse[fault_class(PAGE_PHY(page))]++;
+    } else if (is_zero_page(PAGE_PHY(page)) && (zpage = zero_pool_get(PAGE_PHY(page)->class))) {
+        /* Zero-filled memory does not need to be copied */
+        res = map_page(spc, va, zpage, page->state & PROT_ALL & ~PROT_LAZY);
+        if (!res) fault_stats.zero[fault_class(zpage)]++;
+        page_unref(zpage);
     } else {
         if (trace_memory) {
             cprintf("<%p> Allocating new page [%08lX, %08lX] flags=%x\n", spc,
-                    va, va + (long)CLASS_MASK(page->phy->class), page->state & PROT_ALL & ~PROT_LAZY);
+                    va, va + (long)CLASS_MASK(PAGE_PHY(page)->class), page->state & PROT_ALL & ~PROT_LAZY);
         }
 
-        struct Page *phy = page->phy;
+        struct Page *phy = PAGE_PHY(page);
         page_ref(phy);
+        /* Failed composite allocation loses mapping of its first half,
+         * so make room for the whole page beforehand */
+        if (free_memory() < CLASS_SIZE(phy->class))
+            reclaim_memory(CLASS_SIZE(phy->class));
         res = alloc_composite_page(spc, va, phy->class, page->state & PROT_ALL & ~PROT_LAZY);
-        if (!res) memcpy_page(spc, va, phy);
+        if (!res) {
+            memcpy_page(spc, va, phy);
+            if (is_zero_page(phy))
+                fault_stats.zero[fault_class(phy)]++;
+            else
+                fault_stats.cow[fault_class(phy)]++;
+        }
         page_unref(phy);
     }
 
-fault:
-    switch_address_space(old);
+    return res;
+}
 
-    if (res == -E_NO_MEM) {
-        if (spc != &kspace) {
-            struct Env *env = (void *)((uint8_t *)spc - offsetof(struct Env, address_space));
-            env_destroy(env);
-        } else
-            panic("Out of memory\n");
+int
+force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
+    /* Kernel PML4E are shared by every AddressSpace
+     * (see share_kernel_pml4()), so kspace changes are
+     * visible from any space without propagation */
+
+    static_assert(!(MAX_USER_ADDRESS & (HUGE_PAGE_SIZE * 512 * 512 - 1)), "MAX_USER_ADDRESS should be aligned on 512GiB");
+
+    /* Kernel addresses are described by kspace
+     * (there's no need to switch to it, page contents
+     * are copied through physical memory mapping) */
+    assert(current_space);
+    if (va > MAX_USER_ADDRESS) spc = &kspace;
+
+    int res = resolve_lazy_page(spc, va, maxclass);
+
+    /* Dropping caches is cheaper than losing the env */
+    for (int i = 0; res == -E_NO_MEM && i < RECLAIM_RETRIES; i++) {
+        if (!reclaim_memory(CLASS_SIZE(MAX_ALLOCATION_CLASS))) break;
+        res = resolve_lazy_page(spc, va, maxclass);
+    }
+
+    if (res == -E_NO_MEM) {
+        fault_stats.oom++;
+        if (spc != &kspace) {
+            struct Env *env = (void *)((uint8_t *)spc - offsetof(struct Env, address_space));
+            env_destroy(env);
+        } else
+            panic("Out of memory\n");
     } else
         assert(!res || res == -E_FAULT);
 
     return res;
 }
 
+/*
+ * Copy-on-write page tables.
+ *
+ * Copying address space on fork() mapping by mapping costs as much
+ * as the parent has mapped. Instead, every 2M range mapped with small
+ * pages is detached from the parent's virtual tree into a subtree held
+ * by separate descriptor, and both spaces get SHARED_NODE referring to it.
+ * The page table of the range is shared too, with all entries
+ * write-protected. The first access requiring the range to be private
+ * (write fault, remapping or unmapping part of it) copies mappings back
+ * into the tree of that space with flags fork() would have set.
+ * The last space using the subtree takes it over with its page table.
+ *
+ * Holder descriptor points to the subtree with left link and counts
+ * SHARED_NODEs with refc. Mappings of the subtree stay accounted in the
+ * space they were detached from (its node has SHARED_OWNER set),
+ * other spaces account the whole page table contents as shared.
+ */
+
+static struct {
+    size_t shared;  /* Page tables shared on fork */
+    size_t copied;  /* Subtrees copied on first private access */
+    size_t adopted; /* Subtrees taken over by the last user */
+} shared_pt_stats;
+
+/* Page directory entry corresponding to 2M page at va */
+static pde_t *
+lookup_pde(struct AddressSpace *spc, uintptr_t va) {
+    if (!(spc->pml4[PML4_INDEX(va)] & PTE_P)) return NULL;
+    pdpe_t *pdp = KADDR(PTE_ADDR(spc->pml4[PML4_INDEX(va)]));
+    if (!(pdp[PDP_INDEX(va)] & PTE_P) || pdp[PDP_INDEX(va)] & PTE_PS) return NULL;
+    pde_t *pd = KADDR(PTE_ADDR(pdp[PDP_INDEX(va)]));
+    return pd + PD_INDEX(va);
+}
+
+/* Same as lookup_pde() but allocates upper level tables if required
+ * (returns NULL if va is covered by 1G page or memory is exhausted) */
+static pde_t *
+alloc_pde(struct AddressSpace *spc, uintptr_t va) {
+    if (alloc_pt(spc->pml4 + PML4_INDEX(va)) < 0) return NULL;
+    pdpe_t *pdpe = (pdpe_t *)KADDR(PTE_ADDR(spc->pml4[PML4_INDEX(va)])) + PDP_INDEX(va);
+    if (*pdpe & PTE_PS || alloc_pt(pdpe) < 0) return NULL;
+    return (pde_t *)KADDR(PTE_ADDR(*pdpe)) + PD_INDEX(va);
+}
+
+inline static struct Page *
+pt_page(pte_t pte) {
+    return page_lookup(NULL, PTE_ADDR(pte), 0, PARTIAL_NODE, 0);
+}
+
+/* Amount of memory mapped by page table */
+static size_t
+pt_mapped_size(pde_t pde) {
+    pte_t *pt = KADDR(PTE_ADDR(pde));
+    size_t count = 0;
+    for (size_t i = 0; i < PT_ENTRY_COUNT; i++)
+        count += pt[i] & PTE_P;
+    return count * CLASS_SIZE(0);
+}
+
+/* Virtual address of the tree node */
+static uintptr_t
+node_address(struct Page *node) {
+    int class = MAX_CLASS;
+    for (struct Page *cur = node; cur->parent; cur = PAGE_PARENT(cur)) class--;
+
+    uintptr_t va = 0;
+    for (; node->parent; class++, node = PAGE_PARENT(node)) {
+        if (PAGE_RIGHT(PAGE_PARENT(node)) == node) va += CLASS_SIZE(class);
+    }
+    return va;
+}
+
+/* Protection fork() maps memory with */
+inline static int
+fork_prot(int prot) {
+    return prot & PROT_SHARE ? prot : prot | PROT_LAZY;
+}
+
+static void
+account_subtree(struct AddressSpace *spc, struct Page *node, int sign) {
+    if (!node) return;
+    if (node->phy) {
+        mapping_account(spc, node, sign);
+        return;
+    }
+    account_subtree(spc, PAGE_LEFT(node), sign);
+    account_subtree(spc, PAGE_RIGHT(node), sign);
+}
+
+/* Map subtree mappings into spc the same way as fork() does */
+static int
+copy_subtree(struct AddressSpace *spc, struct Page *node, uintptr_t va, int class) {
+    if (!node) return 0;
+    if (node->phy) return map_page(spc, va, PAGE_PHY(node), fork_prot(node->state & PROT_ALL));
+
+    int res = copy_subtree(spc, PAGE_LEFT(node), va, class - 1);
+    if (!res) res = copy_subtree(spc, PAGE_RIGHT(node), va + CLASS_SIZE(class - 1), class - 1);
+    return res;
+}
+
+/* Update flags of subtree mappings in place and make
+ * page table entries of shared writable ones writable again */
+static void
+adopt_subtree(struct AddressSpace *spc, struct Page *node, uintptr_t va, int class, pte_t *pt) {
+    if (!node) return;
+    if (node->phy) {
+        node->state = fork_prot(node->state & PROT_ALL) | MAPPING_NODE;
+        mapping_account(spc, node, 1);
+        if (node->state & PROT_W && !(node->state & PROT_LAZY)) {
+            for (size_t i = 0; i < CLASS_SIZE(class) / CLASS_SIZE(0); i++)
+                pt[PT_INDEX(va) + i] |= PTE_W;
+        }
+        return;
+    }
+    adopt_subtree(spc, PAGE_LEFT(node), va, class - 1, pt);
+    adopt_subtree(spc, PAGE_RIGHT(node), va + CLASS_SIZE(class - 1), class - 1, pt);
+}
+
+/* Make range shared on fork private to spc */
+static int
+unshare_subtree(struct AddressSpace *spc, struct Page *node, uintptr_t va) {
+    assert((node->state & NODE_TYPE_MASK) == SHARED_NODE);
+    assert(!(va & CLASS_MASK(SHARED_CLASS)));
+
+    struct Page *holder = link2page(node->subtree), *sub = PAGE_LEFT(holder);
+    pde_t *pde = lookup_pde(spc, va);
+    assert(pde && *pde & PTE_P && !(*pde & PTE_PS));
+
+    if (node->state & SHARED_OWNER) {
+        account_subtree(spc, sub, -1);
+    } else {
+        size_t size = pt_mapped_size(*pde);
+        spc->resident -= size;
+        spc->shared -= size;
+    }
+    node->state = INTERMEDIATE_NODE;
+    node->subtree = 0;
+
+    int res = 0;
+    if (!--holder->refc) {
+        /* Nobody else uses subtree and page table, take them over */
+        node->left = sub->left;
+        node->right = sub->right;
+        if (node->left) PAGE_LEFT(node)->parent = page2link(node);
+        if (node->right) PAGE_RIGHT(node)->parent = page2link(node);
+        free_descriptor(sub);
+        free_descriptor(holder);
+
+        adopt_subtree(spc, node, va, SHARED_CLASS, KADDR(PTE_ADDR(*pde)));
+        shared_pt_stats.adopted++;
+    } else {
+        /* Page table is still used by others, so map copies
+         * of the mappings into a new one */
+        page_unref(pt_page(*pde));
+        *pde = 0;
+        res = copy_subtree(spc, sub, va, SHARED_CLASS);
+        shared_pt_stats.copied++;
+    }
+
+    tlb_invalidate_range(spc, va, va + CLASS_SIZE(SHARED_CLASS));
+    return res;
+}
+
+/* Called for SHARED_NODE being removed from the tree
+ * (page table is dereferenced by remove_pt() afterwards) */
+static void
+drop_subtree(struct AddressSpace *spc, struct Page *node) {
+    struct Page *holder = link2page(node->subtree);
+
+    if (node->state & SHARED_OWNER) {
+        account_subtree(spc, PAGE_LEFT(holder), -1);
+    } else if (spc) {
+        pde_t *pde = lookup_pde(spc, node_address(node));
+        assert(pde && *pde & PTE_P);
+        size_t size = pt_mapped_size(*pde);
+        spc->resident -= size;
+        spc->shared -= size;
+    }
+
+    if (!--holder->refc) {
+        unmap_page_remove(NULL, PAGE_LEFT(holder));
+        free_descriptor(holder);
+    }
+}
+
+/* Share 2M range of sspace mapped with small pages with dspace,
+ * returns 1 if it is done and 0 if the range should be copied as usual */
+static int
+share_subtree(struct AddressSpace *dspace, struct AddressSpace *sspace, uintptr_t va, struct Page *vpage) {
+    pde_t *spde = lookup_pde(sspace, va);
+    if (!spde || !(*spde & PTE_P) || *spde & PTE_PS) return 0;
+
+    /* Destination should have nothing mapped there */
+    pde_t *dpde = alloc_pde(dspace, va);
+    if (!dpde || *dpde & PTE_P) return 0;
+
+    struct Page *dnode = page_lookup_virtual(dspace, va, SHARED_CLASS, LOOKUP_ALLOC);
+    if (!dnode) return -E_NO_MEM;
+    assert(dnode->state == INTERMEDIATE_NODE);
+    /* Only empty intermediate nodes might be left there */
+    unmap_page_remove(dspace, PAGE_LEFT(dnode));
+    unmap_page_remove(dspace, PAGE_RIGHT(dnode));
+
+    struct Page *holder;
+    if ((vpage->state & NODE_TYPE_MASK) == SHARED_NODE) {
+        holder = link2page(vpage->subtree);
+    } else {
+        /* Detach subtree from the source tree */
+        holder = alloc_descriptor(SHARED_NODE);
+        struct Page *sub = alloc_descriptor(INTERMEDIATE_NODE);
+        if ((sub->left = vpage->left)) PAGE_LEFT(sub)->parent = page2link(sub);
+        if ((sub->right = vpage->right)) PAGE_RIGHT(sub)->parent = page2link(sub);
+        vpage->left = vpage->right = 0;
+        vpage->state = SHARED_NODE | SHARED_OWNER;
+        vpage->subtree = page2link(holder);
+        holder->left = page2link(sub);
+        holder->refc = 1;
+
+        pte_t *pt = KADDR(PTE_ADDR(*spde));
+        for (size_t i = 0; i < PT_ENTRY_COUNT; i++)
+            pt[i] &= ~PTE_W;
+        tlb_invalidate_range(sspace, va, va + CLASS_SIZE(SHARED_CLASS));
+    }
+
+    dnode->state = SHARED_NODE;
+    dnode->subtree = page2link(holder);
+    holder->refc++;
+
+    *dpde = *spde;
+    page_ref(pt_page(*spde));
+
+    size_t size = pt_mapped_size(*spde);
+    dspace->resident += size;
+    dspace->shared += size;
+    shared_pt_stats.shared++;
+    return 1;
+}
+
+/*
+ * Fault-around.
+ *
+ * Sequential access to memory mapped lazily with small pages
+ * traps on every page. When a fault is resolved by the kernel, lazy
+ * pages of the same mapping within aligned window of env_fault_around
+ * pages around the faulting one are resolved as well.
+ * Window never crosses MAX_ALLOCATION_CLASS boundary.
+ */
+
+/* Fault-around is skipped when memory runs low */
+#define FAULT_AROUND_MIN_FREE (4 * CLASS_SIZE(MAX_ALLOCATION_CLASS))
+
+void
+fault_around(struct AddressSpace *spc, uintptr_t va) {
+    static_assert(FAULT_AROUND_MAX * PAGE_SIZE <= CLASS_SIZE(MAX_ALLOCATION_CLASS), "Window should not cross MAX_ALLOCATION_CLASS page");
+
+    if (spc == &kspace || va >= MAX_USER_ADDRESS) return;
+    struct Env *env = (void *)((uint8_t *)spc - offsetof(struct Env, address_space));
+    env->env_faults++;
+
+    size_t window = MIN((size_t)env->env_fault_around, FAULT_AROUND_MAX) * CLASS_SIZE(0);
+    if (window <= CLASS_SIZE(0) || free_memory() < FAULT_AROUND_MIN_FREE) return;
+
+    int nshared;
+    struct Page *node = page_peek_virtual(spc, va, 0, &nshared);
+    if (!node || !node->phy) return;
+
+    /* Pages of the same mapping only differ by being lazy */
+    int state = node->state | PROT_LAZY;
+    uintptr_t fault_va = va & ~CLASS_MASK(PAGE_PHY(node)->class);
+    uintptr_t start = ROUNDDOWN(va, window), end = start + window;
+
+    tlb_batch_begin();
+    for (uintptr_t cur = start; cur < end;) {
+        node = page_peek_virtual(spc, cur, 0, &nshared);
+        if (!node || !node->phy) {
+            cur += CLASS_SIZE(0);
+            continue;
+        }
+
+        size_t size = CLASS_SIZE(PAGE_PHY(node)->class);
+        uintptr_t page_va = cur & ~(size - 1);
+        /* Larger pages would be allocated beyond the window */
+        if (page_va != fault_va && node->state == state && page_va >= start && page_va + size <= end) {
+            if (resolve_lazy_page(spc, page_va, MAX_ALLOCATION_CLASS) < 0) break;
+            env->env_fault_around_pages += size / CLASS_SIZE(0);
+        }
+        cur = page_va + size;
+    }
+    tlb_batch_end();
+}
+
 static int
 do_map_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, struct Page *phy, int oldflags, int flags) {
     int res;
@@ -1404,10 +2503,10 @@ do_map_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *ssp
         res = force_alloc_page(sspace, src, MAX_CLASS);
         if (res < 0 || (sspace == dspace && src == dst)) return res;
 
-        struct Page *newv = page_lookup_virtual(sspace->root, src, class, LOOKUP_PRESERVE);
+        struct Page *newv = page_lookup_virtual(sspace, src, class, LOOKUP_PRESERVE);
         check_virtual_class(newv, class);
         assert(newv && newv->phy);
-        phy = newv->phy;
+        phy = PAGE_PHY(newv);
     }
 
     page_ref(phy);
@@ -1435,19 +2534,26 @@ do_map_subtree(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *
     int res = 0;
     while (!res && vpage) {
         assert(class >= 0);
+        if (class == SHARED_CLASS && !vpage->phy) {
+            /* fork() shares page tables instead of copying them */
+            if (flags == FORK_FLAGS && sspace != dspace && src == dst &&
+                (res = share_subtree(dspace, sspace, dst, vpage))) return MIN(res, 0);
+            if ((vpage->state & NODE_TYPE_MASK) == SHARED_NODE &&
+                (res = unshare_subtree(sspace, vpage, src)) < 0) return res;
+        }
         if (vpage->phy) {
             assert((vpage->state & NODE_TYPE_MASK) == MAPPING_NODE);
             return do_map_page(dspace, dst, sspace, src,
-                               vpage->phy, vpage->state & PROT_ALL, flags);
+                               PAGE_PHY(vpage), vpage->state & PROT_ALL, flags);
         }
         assert(vpage->state == INTERMEDIATE_NODE);
 
         if (vpage->left && (res = do_map_subtree(dspace, dst,
-                                                 sspace, src, vpage->left, class - 1, flags)) < 0) break;
+                                                 sspace, src, PAGE_LEFT(vpage), class - 1, flags)) < 0) break;
 
         dst += CLASS_SIZE(class - 1);
         src += CLASS_SIZE(class - 1);
-        vpage = vpage->right;
+        vpage = PAGE_RIGHT(vpage);
         class --;
     }
     return res;
@@ -1455,6 +2561,54 @@ do_map_subtree(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *
 
 static struct Page *zero_page, *one_page;
 
+/* Map 0x00/0xFF-filled memory lazily using special filler pages */
+static int
+map_filler_page(struct AddressSpace *dspace, uintptr_t dst, int class, int flags) {
+    /* Get filler page of appropriate size */
+    struct Page *cpage = flags & ALLOC_ONE ? one_page : zero_page;
+    cpage = page_lookup(cpage, page2pa(cpage), MIN(class, MAX_ALLOCATION_CLASS), PARTIAL_NODE, 1);
+    if (!cpage) return -E_NO_MEM;
+
+    /* And then just map them */
+    size_t size_inc = CLASS_SIZE(MIN(class, MAX_ALLOCATION_CLASS));
+    uintptr_t end = dst + CLASS_SIZE(class);
+    assert(CLASS_SIZE(cpage->class) == size_inc);
+    assert(!(flags & PROT_SHARE));
+    int res = 0;
+    while (dst < end && !res) {
+        res = map_page(dspace, dst, cpage, (flags & PROT_ALL & ~PROT_COMBINE) | PROT_LAZY);
+        dst += size_inc;
+    }
+    return res;
+}
+
+/* Allocate 0x00/0xFF-filled memory right away (ALLOC_POPULATE/ALLOC_HUGE).
+ * Without ALLOC_HUGE pages are no larger than the ones allocated on
+ * page fault, with it the whole aligned block is tried first.
+ * Population is only a hint, so parts that cannot be allocated
+ * are mapped lazily instead of failing the whole call */
+static int
+populate_page(struct AddressSpace *dspace, uintptr_t dst, int class, int flags) {
+    int chunk = flags & ALLOC_HUGE ? class : MIN(class, MAX_ALLOCATION_CLASS);
+    int prot = flags & PROT_ALL & ~(PROT_LAZY | PROT_COMBINE);
+
+    for (uintptr_t end = dst + CLASS_SIZE(class); dst < end; dst += CLASS_SIZE(chunk)) {
+        struct Page *page = flags & ALLOC_ZERO ? zero_pool_get(chunk) : NULL;
+        int res;
+        if (page) {
+            res = map_page(dspace, dst, page, prot);
+            page_unref(page);
+        } else if (free_memory() >= CLASS_SIZE(chunk) && !(res = alloc_composite_page(dspace, dst, chunk, prot))) {
+            memset_page(dspace, dst, flags & ALLOC_ONE ? 0xFF : 0x00, CLASS_SIZE(chunk));
+        } else {
+            res = map_filler_page(dspace, dst, chunk, flags);
+        }
+        if (res < 0) return res;
+    }
+
+    return 0;
+}
+
 static int
 do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, int class, int flags) {
     if (dspace == sspace && src != dst) assert(ABSDIFF(dst, src) >= CLASS_SIZE(class));
@@ -1465,40 +2619,20 @@ do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct Addres
             /* Shared pages cannot be lazily allocated
              * So just allocate them and filled with 0's/FF's */
             res = alloc_composite_page(dspace, dst, class, flags & PROT_ALL & ~(PROT_LAZY | PROT_COMBINE));
-            if (!res) {
-                assert(current_space);
-                assert(dspace);
-                struct AddressSpace *old = switch_address_space(dspace);
-                set_wp(0);
-                nosan_memset((void *)dst, flags & ALLOC_ONE ? 0xFF : 0x00, CLASS_SIZE(class));
-                set_wp(1);
-                switch_address_space(old);
-            }
+            if (!res) memset_page(dspace, dst, flags & ALLOC_ONE ? 0xFF : 0x00, CLASS_SIZE(class));
+        } else if (flags & ALLOC_POPULATE || (flags & ALLOC_HUGE && class >= MAX_ALLOCATION_CLASS)) {
+            res = populate_page(dspace, dst, class, flags);
         } else {
             /* MAP_ZERO and MAP_ONE ignore sspace and source and
              * use special 0x00/0xFF-filled pages */
-
-            /* Get filler page of appropriate size */
-            struct Page *cpage = flags & ALLOC_ONE ? one_page : zero_page;
-            cpage = page_lookup(cpage, page2pa(cpage), MIN(class, MAX_ALLOCATION_CLASS), PARTIAL_NODE, 1);
-            if (!cpage) return -E_NO_MEM;
-
-            /* And then just map them */
-            size_t size_inc = CLASS_SIZE(MIN(class, MAX_ALLOCATION_CLASS));
-            uintptr_t end = dst + CLASS_SIZE(class);
-            assert(CLASS_SIZE(cpage->class) == size_inc);
-            assert(!(flags & PROT_SHARE));
-            while (dst < end && !res) {
-                res = map_page(dspace, dst, cpage, (flags & PROT_ALL & ~PROT_COMBINE) | PROT_LAZY);
-                dst += size_inc;
-            }
+            res = map_filler_page(dspace, dst, class, flags);
         }
     } else {
-        struct Page *page1 = page_lookup_virtual(sspace->root, src, class, LOOKUP_ALLOC);
+        struct Page *page1 = page_lookup_virtual(sspace, src, class, LOOKUP_ALLOC);
         assert(page1);
-        if (page1->phy && page1->phy->class > class) {
+        if (page1->phy && PAGE_PHY(page1)->class > class) {
             /* We need to split physical page if part of it is remapped */
-            struct Page *page = page_lookup(page1->phy, src, class, PARTIAL_NODE, 1);
+            struct Page *page = page_lookup(PAGE_PHY(page1), src, class, PARTIAL_NODE, 1);
             return do_map_page(dspace, dst, sspace, src, page, page1->state & PROT_ALL, flags);
         } else {
             check_virtual_class(page1, class);
@@ -1522,11 +2656,12 @@ map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspa
     assert(sspace != dspace || dst <= src || ABSDIFF(src, dst) >= size);
 
     uintptr_t end = dst + size;
-    int max_class = addr_common_class(src, dst), class = 0, res;
+    int max_class = addr_common_class(src, dst), class = 0, res = 0;
+    tlb_batch_begin();
     for (; class < max_class && dst + CLASS_SIZE(class) <= end; class ++) {
         if (dst & CLASS_SIZE(class)) {
             res = do_map_region_one_page(dspace, dst, sspace, src, class, flags);
-            if (res < 0) return res;
+            if (res < 0) goto finish;
             dst += CLASS_SIZE(class);
             src += CLASS_SIZE(class);
         }
@@ -1535,40 +2670,1228 @@ map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspa
     for (; class >= 0 && dst < end; class --) {
         while (dst + CLASS_SIZE(class) <= end) {
             res = do_map_region_one_page(dspace, dst, sspace, src, class, flags);
-            if (res < 0) return res;
+            if (res < 0) goto finish;
             dst += CLASS_SIZE(class);
             src += CLASS_SIZE(class);
         }
     }
 
-    return 0;
+finish:
+    tlb_batch_end();
+    return res < 0 ? res : 0;
+}
+
+/*
+ * Transparent huge pages.
+ *
+ * Memory faulted in 4K at a time stays in 4K pages,
+ * so while CPU is idle address spaces of envs with ENV_MM_THP
+ * are scanned for 2M ranges fully populated with private pages
+ * of the same protection. Such ranges are copied into single
+ * 2M page and mapped with single PDE.
+ */
+
+#define THP_CLASS           9
+#define THP_SCAN_BUDGET     64 /* 2M ranges looked at per idle call */
+#define THP_COLLAPSE_BUDGET 4  /* 2M ranges collapsed per idle call */
+
+static struct {
+    size_t scanned;   /* 2M ranges looked at */
+    size_t collapsed; /* 2M ranges remapped with huge page */
+    size_t nomem;     /* Collapses failed due to lack of 2M pages */
+} thp_stats;
+
+/* Scan cursor: env index and address within it */
+static size_t thp_env;
+static uintptr_t thp_va;
+
+/* Passes over all envs CPU idle time is used for, scanning stops
+ * asking for it after passes that collapse nothing */
+#define THP_WAKE_PASSES 2
+static size_t thp_passes_left;
+static size_t thp_pass_collapsed;
+
+/* Returns protection of the range if it is completely mapped
+ * with private (not lazy, not shared, not device) memory
+ * with protection prot (or any, if prot < 0), -1 otherwise */
+static int
+thp_range_prot(struct Page *node, int prot) {
+    if (!node) return -1;
+
+    if (node->phy) {
+        int nprot = node->state & PROT_ALL;
+        if (prot >= 0 && nprot != prot) return -1;
+        /* Device memory might be target of DMA */
+        if (nprot & (PROT_LAZY | PROT_SHARE | PROT_CD)) return -1;
+        if (PAGE_PHY(node)->state != ALLOCATABLE_NODE || !PAGE_IS_UNIQ(PAGE_PHY(node))) return -1;
+        return nprot;
+    }
+
+    if ((prot = thp_range_prot(PAGE_LEFT(node), prot)) < 0) return -1;
+    return thp_range_prot(PAGE_RIGHT(node), prot);
+}
+
+static void
+thp_copy(struct Page *node, uint8_t *dst, int class) {
+    if (node->phy) {
+        nosan_memcpy(dst, KADDR(page2pa(PAGE_PHY(node))), CLASS_SIZE(class));
+        return;
+    }
+    thp_copy(PAGE_LEFT(node), dst, class - 1);
+    thp_copy(PAGE_RIGHT(node), dst + CLASS_SIZE(class - 1), class - 1);
+}
+
+inline static bool in_cache_region(struct Env *env, uintptr_t va, size_t size);
+
+static bool
+thp_collapse(struct AddressSpace *spc, struct Page *node, uintptr_t va) {
+    /* Cache blocks are remapped and written back 4K at a time,
+     * splitting huge page would mark all of them dirty */
+    struct Env *env = (void *)((uint8_t *)spc - offsetof(struct Env, address_space));
+    if (in_cache_region(env, va, HUGE_PAGE_SIZE)) return 0;
+
+    int prot = thp_range_prot(node, -1);
+    if (prot < 0) return 0;
+
+    pde_t *pde = lookup_pde(spc, va);
+    if (!pde || !(*pde & PTE_P) || *pde & PTE_PS) return 0;
+
+    /* Accessed and dirty bits are kept by hardware only in page tables */
+    pte_t *pt = KADDR(PTE_ADDR(*pde));
+    pte_t accessed = 0;
+    size_t ndirty = 0;
+    for (size_t i = 0; i < PT_ENTRY_COUNT; i++) {
+        if (!(pt[i] & PTE_P)) return 0;
+        accessed |= pt[i] & PTE_A;
+        ndirty += !!(pt[i] & PTE_D);
+    }
+    /* Dirty bits are used to find blocks to write back
+     * (e.g. by file server), so they should not be lost or gained */
+    if (ndirty && ndirty != PT_ENTRY_COUNT) return 0;
+
+    struct Page *page = alloc_page(THP_CLASS, 0);
+    if (!page) {
+        thp_stats.nomem++;
+        return 0;
+    }
+
+    thp_copy(node, KADDR(page2pa(page)), THP_CLASS);
+
+    /* Make sure remapping does not run out of descriptors
+     * after old pages are already gone */
+    ensure_free_desc(2 * MAX_CLASS);
+    int res = map_page(spc, va, page, prot);
+    assert(!res);
+
+    pde = lookup_pde(spc, va);
+    assert(pde && *pde & PTE_PS);
+    *pde |= accessed | (ndirty ? PTE_D : 0);
+
+    if (trace_memory) cprintf("<%p> Collapsed [%08lX, %08lX] into huge page\n",
+                              spc, va, va + (long)CLASS_MASK(THP_CLASS));
+    return 1;
+}
+
+static void
+thp_scan(struct AddressSpace *spc, struct Page *node, int class, uintptr_t va, size_t *budget, size_t *collapse) {
+    if (!node || !*budget || !*collapse) return;
+    /* Skip parts already scanned and ranges mapped with larger pages */
+    if (va + CLASS_SIZE(class) <= thp_va || node->phy) return;
+
+    if (class == THP_CLASS) {
+        thp_va = va + CLASS_SIZE(class);
+        thp_stats.scanned++;
+        (*budget)--;
+        if (thp_collapse(spc, node, va)) {
+            thp_stats.collapsed++;
+            (*collapse)--;
+        }
+        return;
+    }
+
+    thp_scan(spc, PAGE_LEFT(node), class - 1, va, budget, collapse);
+    thp_scan(spc, PAGE_RIGHT(node), class - 1, va + CLASS_SIZE(class - 1), budget, collapse);
+}
+
+static void
+thp_collapse_idle(void) {
+    size_t budget = THP_SCAN_BUDGET, collapse = THP_COLLAPSE_BUDGET;
+
+    for (size_t i = 0; i < NENV; i++) {
+        struct Env *env = &envs[thp_env];
+        /* Env that yielded CPU is scanned too */
+        if ((env->env_status == ENV_RUNNABLE || env->env_status == ENV_RUNNING ||
+             env->env_status == ENV_NOT_RUNNABLE) &&
+            env->env_mm_flags & ENV_MM_THP && env->address_space.root) {
+            struct AddressSpace *spc = &env->address_space;
+            tlb_batch_begin();
+            thp_scan(spc, spc->root, MAX_CLASS, 0, &budget, &collapse);
+            tlb_batch_end();
+            /* Continue from the same place next time */
+            if (!budget || !collapse) return;
+        }
+        thp_env = (thp_env + 1) % NENV;
+        thp_va = 0;
+
+        if (!thp_env) {
+            if (thp_stats.collapsed != thp_pass_collapsed)
+                thp_passes_left = THP_WAKE_PASSES;
+            else if (thp_passes_left)
+                thp_passes_left--;
+            thp_pass_collapsed = thp_stats.collapsed;
+        }
+    }
 }
 
+static bool
+thp_pending(void) {
+    return thp_passes_left;
+}
+
+/* Some env enabled ENV_MM_THP, use idle
+ * time for scanning even if nothing else needs it */
 void
-release_address_space(struct AddressSpace *space) {
-    /* NOTE: This function should not be called for kspace */
+thp_wake(void) {
+    thp_passes_left = THP_WAKE_PASSES;
+}
 
-    /* Manually unref level 3 kernel page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (kspace.pml4[i] & PTE_P && i != UVPT_INDEX)
-            page_unref(page_lookup(NULL, PTE_ADDR(kspace.pml4[i]), 0, PARTIAL_NODE, 0));
+void
+dump_thp_stats(void) {
+    cprintf("THP: scanned=%zu collapsed=%zu nomem=%zu\n",
+            thp_stats.scanned, thp_stats.collapsed, thp_stats.nomem);
+    for (size_t i = 0; i < NENV; i++) {
+        if (envs[i].env_status != ENV_FREE && envs[i].env_mm_flags & ENV_MM_THP)
+            cprintf("THP: enabled for env %08x\n", envs[i].env_id);
+    }
+}
+
+/*
+ * Deferred address space teardown.
+ *
+ * Freeing big address space takes long, so release_address_space()
+ * only detaches the space from its env and queues it. The tree and
+ * user page tables are freed piece by piece from the idle loop,
+ * or all at once when memory runs out (as the first shrinker).
+ */
+
+struct DeadSpace {
+    struct AddressSpace space;
+    size_t pdpi;     /* Next PDP entry to be freed */
+    uint64_t queued; /* TSC value when space was queued */
+    uint64_t cycles; /* Time spent tearing space down */
+    struct DeadSpace *next;
+};
+
+static struct DeadSpace *dead_spaces, **dead_spaces_tail = &dead_spaces;
+
+static struct {
+    size_t queued, done;
+    uint64_t release_cycles; /* Spent in release_address_space() */
+    uint64_t work_cycles;    /* Spent freeing queued spaces */
+    uint64_t wait_cycles;    /* From queueing to completion */
+} teardown_stats;
+
+/* Free parts of dead address space, returns true when it is completely gone */
+static bool
+teardown_step(struct AddressSpace *spc, size_t *pdpi, size_t *budget) {
+    /* Free leaf nodes of the tree one at a time
+     * (mappings release their physical pages) */
+    while (spc->root && *budget) {
+        struct Page *node = spc->root;
+        while (node->left || node->right)
+            node = node->left ? PAGE_LEFT(node) : PAGE_RIGHT(node);
+        if (node == spc->root) spc->root = NULL;
+        unmap_page_remove(spc, node);
+        --*budget;
+    }
+    if (spc->root) return 0;
+
+    /* Then user page tables, 1GB at a time */
+    static_assert(NUSERPML4 == 1, "Only the first PML4 entry is torn down incrementally");
+    if (spc->pml4[0] & PTE_P) {
+        pdpe_t *pdp = KADDR(PTE_ADDR(spc->pml4[0]));
+        for (; *pdpi < PDP_ENTRY_COUNT && *budget; ++*pdpi, --*budget)
+            remove_pt(pdp, 0, 1 * GB, *pdpi, *pdpi + 1);
+        if (*pdpi < PDP_ENTRY_COUNT) return 0;
+        remove_pt(spc->pml4, 0, 512 * GB, 0, NUSERPML4);
+    }
+
+    /* PML4 is freed the last */
+    page_unref(page_lookup(NULL, spc->cr3, 0, PARTIAL_NODE, 0));
+    return 1;
+}
+
+static bool
+teardown_pending(void) {
+    return dead_spaces;
+}
+
+/* Make progress on queued address spaces, budget of 0 means drain them all */
+static void
+teardown_drain(size_t budget) {
+    /* Allocations made while freeing should not recurse here */
+    static bool teardown_active;
+    if (teardown_active) return;
+    teardown_active = 1;
+
+    bool all = !budget;
+
+    while (dead_spaces && (all || budget)) {
+        struct DeadSpace *dead = dead_spaces;
+        size_t left = all ? SIZE_MAX : budget;
+
+        uint64_t start = read_tsc();
+        bool done = teardown_step(&dead->space, &dead->pdpi, &left);
+        uint64_t end = read_tsc();
+        dead->cycles += end - start;
+        teardown_stats.work_cycles += end - start;
+        if (!all) budget = left;
+        if (!done) continue;
+
+        teardown_stats.done++;
+        teardown_stats.wait_cycles += end - dead->queued;
+        if (trace_memory) cprintf("Address space %p is freed in %lu cycles (%lu after queueing)\n",
+                                  (void *)dead->space.cr3, (unsigned long)dead->cycles,
+                                  (unsigned long)(end - dead->queued));
+
+        if (!(dead_spaces = dead->next)) dead_spaces_tail = &dead_spaces;
+        kfree(dead);
     }
 
-    /* Unmap all memory from the space
-     * (kernel is cheating and does not store
-     *  metadata for upper part of address space (privileged)
-     *  in tree and only in page tables for user address spaces,
-     *  so unmapping is safe) */
-    unmap_page(space, 0, MAX_CLASS);
+    teardown_active = 0;
+}
 
-    /* Also unmap PML4 itself since it is never deallocated by page_uname*/
-    page_unref(page_lookup(NULL, space->cr3, 0, PARTIAL_NODE, 0));
+void
+release_address_space(struct AddressSpace *space) {
+    /* NOTE: This function should not be called for kspace */
+    assert(space != &kspace && space != current_space);
+    uint64_t start = read_tsc();
+
+    /* Drop everything cached for the space while its PCID is known,
+     * so pages can be reused as soon as they are freed */
+    tlb_flush_range(space, 0, MAX_USER_ADDRESS);
+
+    struct DeadSpace *dead = kmalloc(sizeof *dead);
+    if (dead) {
+        dead->space = *space;
+        dead->pdpi = 0;
+        dead->cycles = 0;
+        dead->queued = start;
+        dead->next = NULL;
+        *dead_spaces_tail = dead;
+        dead_spaces_tail = &dead->next;
+        teardown_stats.queued++;
+    } else {
+        size_t budget = SIZE_MAX, pdpi = 0;
+        teardown_step(space, &pdpi, &budget);
+    }
 
     /* Zero-out metadata */
     memset(space, 0, sizeof *space);
+    teardown_stats.release_cycles += read_tsc() - start;
+}
+
+/*
+ * Memory reclaim.
+ *
+ * When page fault cannot allocate memory, registered shrinkers are
+ * asked to free some, cheapest first, and allocation is retried.
+ * Built-in shrinkers drop allocator caches and free slabs, replace
+ * zero-filled private pages with lazy mappings of zero_page and drop
+ * clean pages of env cache regions (e.g. file server block cache),
+ * which the env faults back in from its own storage.
+ */
+
+/* Remapping might need new descriptor pool, so shrinkers
+ * stop before descriptors run low */
+#define RECLAIM_MIN_DESC (2 * (MAX_CLASS + 1))
+
+static struct Shrinker *shrinkers;
+
+static struct {
+    size_t runs;  /* reclaim_memory() calls */
+    size_t freed; /* Total amount of memory freed */
+} reclaim_stats;
+
+void
+register_shrinker(struct Shrinker *shrinker) {
+    struct Shrinker **last = &shrinkers;
+    while (*last) last = &(*last)->next;
+    shrinker->next = NULL;
+    *last = shrinker;
+}
+
+/* Run shrinkers until target bytes are freed (or nothing is left),
+ * returns amount of memory actually freed */
+size_t
+reclaim_memory(size_t target) {
+    if (reclaim_active) return 0;
+    reclaim_active = 1;
+    tlb_batch_begin();
+
+    size_t freed = 0;
+    for (struct Shrinker *shrinker = shrinkers; shrinker && freed < target; shrinker = shrinker->next) {
+        size_t before = free_memory();
+        shrinker->shrink(target - freed);
+        size_t after = free_memory();
+
+        shrinker->calls++;
+        if (after > before) {
+            shrinker->freed += after - before;
+            freed += after - before;
+        }
+    }
+
+    /* Freed pages are handed out right away, so
+     * stale TLB entries cannot wait for the outer batch */
+    tlb_batch_flush();
+    tlb_batch_end();
+    reclaim_active = 0;
+
+    reclaim_stats.runs++;
+    reclaim_stats.freed += freed;
+    if (trace_memory) cprintf("Reclaimed %zuK of %zuK requested\n", (size_t)(freed / KB), (size_t)(target / KB));
+    return freed;
+}
+
+static void
+shrink_dead_spaces(size_t target) {
+    teardown_drain(0);
+}
+
+static void
+shrink_page_caches(size_t target) {
+    drain_page_caches();
+}
+
+static void
+shrink_slabs(size_t target) {
+    kmem_reclaim();
+}
+
+inline static bool
+reclaim_env(struct Env *env) {
+    return (env->env_status == ENV_RUNNABLE || env->env_status == ENV_RUNNING ||
+            env->env_status == ENV_NOT_RUNNABLE) && env->address_space.root;
+}
+
+/* Private page nobody else references */
+inline static bool
+reclaim_private(struct Page *node) {
+    struct Page *phy = PAGE_PHY(node);
+    return !(node->state & (PROT_SHARE | PROT_LAZY)) &&
+           phy->state == ALLOCATABLE_NODE && PAGE_IS_UNIQ(phy);
+}
+
+inline static bool
+in_cache_region(struct Env *env, uintptr_t va, size_t size) {
+    return va < env->env_cache_va + env->env_cache_size && va + size > env->env_cache_va;
+}
+
+static bool
+page_is_zero(struct Page *page) {
+    uint64_t *ptr = KADDR(page2pa(page));
+    uint64_t *end = ptr + CLASS_SIZE(page->class) / sizeof(*ptr);
+
+    for (; ptr < end; ptr++)
+        if (*ptr) return 0;
+    return 1;
+}
+
+static void
+shrink_zero_scan(struct Env *env, struct Page *zpage, struct Page *node, int class, uintptr_t va, size_t *left) {
+    if (!node || !*left || free_desc_count < RECLAIM_MIN_DESC) return;
+
+    if (!node->phy) {
+        shrink_zero_scan(env, zpage, PAGE_LEFT(node), class - 1, va, left);
+        shrink_zero_scan(env, zpage, PAGE_RIGHT(node), class - 1, va + CLASS_SIZE(class - 1), left);
+        return;
+    }
+
+    if (class || !reclaim_private(node)) return;
+    /* Devices may still write to DMA buffers */
+    if (node->state & PROT_CD) return;
+    /* Dirty cache pages still need to be written back */
+    if (in_cache_region(env, va, PAGE_SIZE)) return;
+    if (!page_is_zero(PAGE_PHY(node))) return;
+
+    int res = map_page(&env->address_space, va, zpage, (node->state & PROT_ALL) | PROT_LAZY);
+    assert(!res);
+    *left -= MIN(*left, PAGE_SIZE);
+}
+
+/* Replace private 4K pages filled with zeroes by zero_page mappings */
+static void
+shrink_zero_pages(size_t target) {
+    struct Page *zpage = page_lookup(zero_page, page2pa(zero_page), 0, PARTIAL_NODE, 1);
+    if (!zpage) return;
+
+    for (size_t i = 0; i < NENV && target; i++) {
+        if (reclaim_env(&envs[i]))
+            shrink_zero_scan(&envs[i], zpage, envs[i].address_space.root, MAX_CLASS, 0, &target);
+    }
+}
+
+/* All hardware entries of the mapping are present and not dirty */
+static bool
+range_is_clean(struct AddressSpace *spc, uintptr_t va, int class) {
+    pde_t *pde = lookup_pde(spc, va);
+    if (!pde || class >= 18) return 0;
+
+    if (class >= THP_CLASS) {
+        for (size_t i = 0; i < CLASS_SIZE(class) / (2 * MB); i++)
+            if (!(pde[i] & PTE_P) || !(pde[i] & PTE_PS) || pde[i] & PTE_D) return 0;
+        return 1;
+    }
+
+    if (!(*pde & PTE_P) || *pde & PTE_PS) return 0;
+    pte_t *pte = (pte_t *)KADDR(PTE_ADDR(*pde)) + PT_INDEX(va);
+    for (size_t i = 0; i < CLASS_SIZE(class) / PAGE_SIZE; i++)
+        if (!(pte[i] & PTE_P) || pte[i] & PTE_D) return 0;
+    return 1;
+}
+
+static void
+shrink_clean_scan(struct Env *env, struct Page *node, int class, uintptr_t va, size_t *left) {
+    if (!node || !*left || free_desc_count < RECLAIM_MIN_DESC) return;
+    if (!in_cache_region(env, va, CLASS_SIZE(class))) return;
+
+    if (!node->phy) {
+        shrink_clean_scan(env, PAGE_LEFT(node), class - 1, va, left);
+        shrink_clean_scan(env, PAGE_RIGHT(node), class - 1, va + CLASS_SIZE(class - 1), left);
+        return;
+    }
+
+    if (va < env->env_cache_va || va + CLASS_SIZE(class) > env->env_cache_va + env->env_cache_size) return;
+    if (!reclaim_private(node) || !range_is_clean(&env->address_space, va, class)) return;
+
+    unmap_page(&env->address_space, va, class);
+    *left -= MIN(*left, CLASS_SIZE(class));
+}
+
+/* Drop clean pages from cache regions */
+static void
+shrink_clean_pages(size_t target) {
+    for (size_t i = 0; i < NENV && target; i++) {
+        if (reclaim_env(&envs[i]) && envs[i].env_cache_size)
+            shrink_clean_scan(&envs[i], envs[i].address_space.root, MAX_CLASS, 0, &target);
+    }
+}
+
+static void
+shrink_free_scan(struct Env *env, struct Page *node, int class, uintptr_t va, size_t *left) {
+    if (!node || !*left || free_desc_count < RECLAIM_MIN_DESC) return;
+
+    if (!node->phy) {
+        shrink_free_scan(env, PAGE_LEFT(node), class - 1, va, left);
+        shrink_free_scan(env, PAGE_RIGHT(node), class - 1, va + CLASS_SIZE(class - 1), left);
+        return;
+    }
+
+    /* Written since it was marked, contents are needed again */
+    if (!(node->state & MAPPING_FREE) || class > MAX_ALLOCATION_CLASS) return;
+    /* DMA does not set dirty bits, so clean device memory may be in use */
+    if (node->state & PROT_CD) return;
+    if (!reclaim_private(node) || !range_is_clean(&env->address_space, va, class)) return;
+
+    struct Page *zpage = page_lookup(zero_page, page2pa(zero_page), class, PARTIAL_NODE, 1);
+    if (!zpage) return;
+
+    int res = map_page(&env->address_space, va, zpage, (node->state & PROT_ALL) | PROT_LAZY);
+    assert(!res);
+    *left -= MIN(*left, CLASS_SIZE(class));
+}
+
+/* Replace clean pages marked with ADVISE_FREE by zero_page mappings */
+static void
+shrink_free_pages(size_t target) {
+    for (size_t i = 0; i < NENV && target; i++) {
+        if (reclaim_env(&envs[i]))
+            shrink_free_scan(&envs[i], envs[i].address_space.root, MAX_CLASS, 0, &target);
+    }
+}
+
+static struct Shrinker builtin_shrinkers[] = {
+        {.name = "teardown", .shrink = shrink_dead_spaces},
+        {.name = "pagecache", .shrink = shrink_page_caches},
+        {.name = "slab", .shrink = shrink_slabs},
+        {.name = "free", .shrink = shrink_free_pages},
+        {.name = "zero", .shrink = shrink_zero_pages},
+        {.name = "clean", .shrink = shrink_clean_pages},
+};
+
+/*
+ * Region advice (sys_region_advise()).
+ *
+ * ADVISE_DONTNEED replaces private memory of the range with lazy
+ * zero-filled mappings, ADVISE_WILLNEED resolves writable lazy
+ * mappings right away. ADVISE_FREE marks private pages (except
+ * device memory, which DMA writes without setting dirty bits) with
+ * MAPPING_FREE and clears their dirty bits, so pages that are still
+ * clean when memory runs out are replaced with zero pages by
+ * shrink_free_pages(). Writing to a page keeps its contents,
+ * remapping it drops the mark.
+ */
+
+static int
+advise_dontneed(struct AddressSpace *spc, uintptr_t va, uintptr_t end) {
+    int res = 0;
+
+    while (va < end && !res) {
+        struct Page *node = page_lookup_virtual(spc, va, 0, LOOKUP_PRESERVE);
+        if (!node || !node->phy) {
+            va += CLASS_SIZE(0);
+            continue;
+        }
+
+        struct Page *phy = PAGE_PHY(node);
+        uintptr_t next = MIN((va & ~CLASS_MASK(phy->class)) + CLASS_SIZE(phy->class), end);
+        /* Shared and device memory is not ours to drop,
+         * filler pages have no backing memory to begin with */
+        if (!(node->state & PROT_SHARE) && phy->state == ALLOCATABLE_NODE && !is_zero_page(phy))
+            res = map_region(spc, va, NULL, 0, next - va, (node->state & PROT_ALL) | ALLOC_ZERO | PROT_LAZY);
+        va = next;
+    }
+
+    return res;
+}
+
+static void
+advise_willneed(struct AddressSpace *spc, uintptr_t va, uintptr_t end) {
+    /* This is only a hint, so it should not cause reclaim */
+    while (va < end && free_memory() >= FAULT_AROUND_MIN_FREE) {
+        struct Page *node = page_lookup_virtual(spc, va, 0, LOOKUP_PRESERVE);
+        if (!node || !node->phy) {
+            va += CLASS_SIZE(0);
+            continue;
+        }
+
+        /* Read-only lazy pages are never copied on access */
+        if ((node->state & (PROT_LAZY | PROT_W)) == (PROT_LAZY | PROT_W)) {
+            if (resolve_lazy_page(spc, va, MAX_ALLOCATION_CLASS) < 0) break;
+            continue;
+        }
+
+        va = (va & ~CLASS_MASK(PAGE_PHY(node)->class)) + CLASS_SIZE(PAGE_PHY(node)->class);
+    }
+}
+
+static void
+advise_free(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
+    for (uintptr_t va = start; va < end;) {
+        struct Page *node = page_lookup_virtual(spc, va, 0, LOOKUP_PRESERVE);
+        if (!node || !node->phy) {
+            va += CLASS_SIZE(0);
+            continue;
+        }
+
+        /* Only pages lying within the range completely can be dropped */
+        struct Page *phy = PAGE_PHY(node);
+        uintptr_t page_va = va & ~CLASS_MASK(phy->class);
+        if (page_va >= start && page_va + CLASS_SIZE(phy->class) <= end &&
+            !(node->state & PROT_CD) && reclaim_private(node)) {
+            /* Remapping clears dirty bits */
+            int res = map_page(spc, page_va, phy, (node->state & PROT_ALL) | MAPPING_FREE);
+            assert(!res);
+        }
+        va = page_va + CLASS_SIZE(phy->class);
+    }
+}
+
+/* Apply memory usage advice to [va, va + size) of spc.
+ * ADVISE_NORMAL, ADVISE_SEQUENTIAL and ADVISE_RANDOM describe
+ * the whole env and are handled by sys_region_advise() */
+int
+advise_region(struct AddressSpace *spc, uintptr_t va, size_t size, int advice) {
+    assert(!(va & CLASS_MASK(0)) && !(size & CLASS_MASK(0)));
+    uintptr_t end = va + size;
+    int res = 0;
+
+    tlb_batch_begin();
+    switch (advice) {
+    case ADVISE_DONTNEED:
+        res = advise_dontneed(spc, va, end);
+        break;
+    case ADVISE_WILLNEED:
+        advise_willneed(spc, va, end);
+        break;
+    case ADVISE_FREE:
+        advise_free(spc, va, end);
+        break;
+    default:
+        res = -E_INVAL;
+    }
+    tlb_batch_end();
+
+    return res;
+}
+
+/*
+ * Same-page merging.
+ *
+ * Envs forked from the same image or loaded from the same ELF
+ * keep identical private pages after copy-on-write breaks them.
+ * While CPU is idle private 4K pages of envs with ENV_MM_KSM are
+ * hashed. A page equal to one merged earlier (stable table) or to
+ * one seen earlier during the same pass (unstable table) is mapped
+ * lazily to a single physical page, so writing to it unmerges it
+ * by the usual copy-on-write fault. Zero-filled pages are mapped
+ * to zero_page instead.
+ */
+
+#define KSM_SCAN_BUDGET   256  /* Mappings looked at per idle call */
+#define KSM_STABLE_SIZE   1024 /* Merged pages available for lookup */
+#define KSM_UNSTABLE_SIZE 4096 /* Pages remembered during one pass */
+
+/* Merged page, the table holds a reference to it */
+struct KsmStable {
+    uint64_t hash;
+    struct Page *page;
+};
+
+/* Page seen during current pass */
+struct KsmCandidate {
+    uint64_t hash;
+    envid_t env;
+    uintptr_t va;
+};
+
+static struct KsmStable ksm_stable[KSM_STABLE_SIZE];
+static struct KsmCandidate ksm_unstable[KSM_UNSTABLE_SIZE];
+
+static struct {
+    size_t passes;  /* Complete scans of all envs */
+    size_t scanned; /* Pages hashed */
+    size_t merged;  /* Pages mapped to another page */
+    size_t zero;    /* Pages mapped to zero_page */
+} ksm_stats;
+
+/* Scan cursor: env index and address within it */
+static size_t ksm_env;
+static uintptr_t ksm_va;
+
+/* Passes timer should keep ticking for, scanning stops
+ * requesting ticks after passes that merge nothing */
+#define KSM_WAKE_PASSES 2
+static size_t ksm_passes_left;
+static size_t ksm_pass_merged;
+
+/* Scanning runs from timer ticks, so the interrupted env is
+ * scanned too: remapped pages just fault on its next write */
+inline static bool
+ksm_env_enabled(struct Env *env) {
+    return (env->env_status == ENV_RUNNABLE || env->env_status == ENV_RUNNING ||
+            env->env_status == ENV_NOT_RUNNABLE) &&
+           env->env_mm_flags & ENV_MM_KSM && env->address_space.root;
+}
+
+/* Private 4K user page that can be merged */
+static bool
+ksm_candidate(struct Env *env, struct Page *node, uintptr_t va) {
+    if (!node || !node->phy || PAGE_PHY(node)->class) return 0;
+    if (!(node->state & PROT_USER_) || node->state & PROT_CD) return 0;
+    /* Dirty cache pages still need to be written back */
+    if (in_cache_region(env, va, PAGE_SIZE)) return 0;
+    return reclaim_private(node);
+}
+
+static uint64_t
+ksm_hash(struct Page *page) {
+    const uint64_t *ptr = KADDR(page2pa(page));
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(*ptr); i++)
+        hash = (hash ^ ptr[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+inline static bool
+ksm_same(struct Page *page1, struct Page *page2) {
+    return !memcmp(KADDR(page2pa(page1)), KADDR(page2pa(page2)), PAGE_SIZE);
+}
+
+static void
+ksm_stable_drop(struct KsmStable *stable) {
+    page_unref(stable->page);
+    stable->page = NULL;
+}
+
+/* Forget candidates of the previous pass and merged pages
+ * that are not mapped anywhere anymore */
+static void
+ksm_new_pass(void) {
+    memset(ksm_unstable, 0, sizeof ksm_unstable);
+    for (size_t i = 0; i < KSM_STABLE_SIZE; i++)
+        if (ksm_stable[i].page && ksm_stable[i].page->refc == 1) ksm_stable_drop(&ksm_stable[i]);
+    ksm_stats.passes++;
+
+    size_t merged = ksm_stats.merged + ksm_stats.zero;
+    if (merged != ksm_pass_merged)
+        ksm_passes_left = KSM_WAKE_PASSES;
+    else if (ksm_passes_left)
+        ksm_passes_left--;
+    ksm_pass_merged = merged;
+}
+
+static bool
+ksm_pending(void) {
+    return ksm_passes_left;
+}
+
+/* Some env enabled ENV_MM_KSM, keep scanning on timer
+ * ticks even if nothing else needs them */
+void
+ksm_wake(void) {
+    ksm_passes_left = KSM_WAKE_PASSES;
+}
+
+/* Mapping remembered in candidate if it is still mergeable */
+static struct Page *
+ksm_candidate_lookup(struct KsmCandidate *cand, struct Env **penv) {
+    struct Env *env = &envs[ENVX(cand->env)];
+    if (!cand->env || env->env_id != cand->env || !ksm_env_enabled(env)) return NULL;
+
+    struct Page *node = page_lookup_virtual(&env->address_space, cand->va, 0, LOOKUP_PRESERVE);
+    if (!ksm_candidate(env, node, cand->va)) return NULL;
+
+    *penv = env;
+    return node;
+}
+
+static void
+ksm_merge(struct Env *env, struct Page *node, uintptr_t va) {
+    struct AddressSpace *spc = &env->address_space;
+    struct Page *phy = PAGE_PHY(node);
+    int prot = (node->state & PROT_ALL) | PROT_LAZY;
+
+    ksm_stats.scanned++;
+    /* Make sure remapping does not run out of descriptors */
+    ensure_free_desc(2 * MAX_CLASS);
+
+    if (page_is_zero(phy)) {
+        struct Page *zpage = page_lookup(zero_page, page2pa(zero_page), 0, PARTIAL_NODE, 1);
+        if (zpage && !map_page(spc, va, zpage, prot)) ksm_stats.zero++;
+        return;
+    }
+
+    uint64_t hash = ksm_hash(phy);
+    struct KsmStable *stable = &ksm_stable[hash % KSM_STABLE_SIZE];
+    if (stable->page && stable->page->refc == 1) ksm_stable_drop(stable);
+    if (stable->page && stable->hash == hash && ksm_same(stable->page, phy)) {
+        int res = map_page(spc, va, stable->page, prot);
+        assert(!res);
+        ksm_stats.merged++;
+        return;
+    }
+
+    struct KsmCandidate *cand = &ksm_unstable[hash % KSM_UNSTABLE_SIZE];
+    struct Env *other_env = NULL;
+    struct Page *other = cand->hash == hash ? ksm_candidate_lookup(cand, &other_env) : NULL;
+    if (!other || other == node || !ksm_same(PAGE_PHY(other), phy)) {
+        *cand = (struct KsmCandidate){.hash = hash, .env = env->env_id, .va = va};
+        return;
+    }
+
+    /* Memory of the other page becomes merged page, it replaces
+     * older entry of the table since recent merges are more likely
+     * to be found again */
+    struct Page *kpage = PAGE_PHY(other);
+    if (stable->page) ksm_stable_drop(stable);
+    page_ref(kpage);
+    *stable = (struct KsmStable){.hash = hash, .page = kpage};
+
+    int res = map_page(&other_env->address_space, cand->va, kpage, (other->state & PROT_ALL) | PROT_LAZY);
+    assert(!res);
+    res = map_page(spc, va, kpage, prot);
+    assert(!res);
+    ksm_stats.merged++;
+
+    if (trace_memory) cprintf("<%p> Merged page %08lX with %08lX of env %08x\n",
+                              spc, va, cand->va, other_env->env_id);
+    memset(cand, 0, sizeof *cand);
+}
+
+static void
+ksm_scan(struct Env *env, struct Page *node, int class, uintptr_t va, size_t *budget) {
+    if (!node || !*budget) return;
+    /* Skip parts already scanned */
+    if (va + CLASS_SIZE(class) <= ksm_va) return;
+
+    if (node->phy) {
+        ksm_va = va + CLASS_SIZE(class);
+        (*budget)--;
+        if (!class && ksm_candidate(env, node, va)) ksm_merge(env, node, va);
+        return;
+    }
+
+    ksm_scan(env, PAGE_LEFT(node), class - 1, va, budget);
+    ksm_scan(env, PAGE_RIGHT(node), class - 1, va + CLASS_SIZE(class - 1), budget);
+}
+
+static void
+ksm_scan_idle(void) {
+    size_t budget = KSM_SCAN_BUDGET;
+
+    for (size_t i = 0; i < NENV; i++) {
+        struct Env *env = &envs[ksm_env];
+        if (ksm_env_enabled(env)) {
+            tlb_batch_begin();
+            ksm_scan(env, env->address_space.root, MAX_CLASS, 0, &budget);
+            tlb_batch_end();
+            /* Continue from the same place next time */
+            if (!budget) return;
+        }
+        if (++ksm_env == NENV) {
+            ksm_env = 0;
+            ksm_new_pass();
+        }
+        ksm_va = 0;
+    }
+}
+
+/* Memory that would be used by merged pages if they were not merged */
+static size_t
+ksm_saved_bytes(void) {
+    size_t res = ksm_stats.zero * PAGE_SIZE;
+    for (size_t i = 0; i < KSM_STABLE_SIZE; i++) {
+        /* One reference is held by the table and one mapping would be left anyway */
+        struct Page *page = ksm_stable[i].page;
+        if (page && page->refc > 2) res += (page->refc - 2) * PAGE_SIZE;
+    }
+    return res;
+}
+
+/*
+ * Memory compaction.
+ *
+ * Small allocations split 2M blocks of physical memory, so after
+ * a while large pages can't be allocated anymore. Compaction picks
+ * 2M blocks with little memory used, where every used page is 4K page
+ * referenced only by mappings in address spaces of envs, copies
+ * these pages elsewhere and remaps them. The block itself is
+ * referenced meanwhile, so its free parts can't be handed out,
+ * and becomes free as a whole once the reference is dropped.
+ * Compaction runs from alloc_composite_page() when 2M page cannot
+ * be allocated and from the idle loop while few 2M blocks are free.
+ */
+
+#define COMPACT_CLASS        MAX_ALLOCATION_CLASS
+#define COMPACT_MAX_USED     (CLASS_SIZE(COMPACT_CLASS) / 4) /* Memory moved out of a block at most */
+#define COMPACT_MAX_MAPPINGS 8                                /* Mappings of a page fixed up at most */
+#define COMPACT_IDLE_TARGET  4                                /* Free 2M blocks idle compaction keeps */
+#define COMPACT_DEFER        64                               /* Runs skipped after all memory was scanned in vain */
+
+static struct {
+    size_t runs;   /* Compaction runs */
+    size_t blocks; /* 2M blocks freed */
+    size_t moved;  /* Pages moved */
+    size_t failed; /* Blocks compaction gave up on */
+} compact_stats;
+
+/* Scan cursor (physical address) */
+static uintptr_t compact_pa;
+static size_t compact_defer;
+static bool compact_active;
+
+struct CompactMapping {
+    struct AddressSpace *spc;
+    uintptr_t va;
+    int prot;
+    pte_t bits; /* Accessed and dirty bits */
+};
+
+/* Address space of env the mapping belongs to */
+static struct AddressSpace *
+mapping_space(struct Page *node) {
+    while (node->parent) node = PAGE_PARENT(node);
+
+    for (size_t i = 0; i < NENV; i++) {
+        if (envs[i].env_status != ENV_FREE && envs[i].address_space.root == node)
+            return &envs[i].address_space;
+    }
+    return NULL;
+}
+
+static pte_t *
+compact_pte(struct AddressSpace *spc, uintptr_t va) {
+    pde_t *pde = lookup_pde(spc, va);
+    if (!pde || !(*pde & PTE_P) || *pde & PTE_PS) return NULL;
+    return (pte_t *)KADDR(PTE_ADDR(*pde)) + PT_INDEX(va);
+}
+
+/* Collect mappings of the page. Returns their number if they hold
+ * all references to the page but 'extra', -1 otherwise */
+static int
+compact_mappings(struct Page *page, int extra, struct CompactMapping *maps) {
+    if (page->class || page->left || page->right || page->state != ALLOCATABLE_NODE) return -1;
+
+    struct List *head = (struct List *)page;
+    int count = 0;
+    for (struct List *cur = head->next ? list_ptr(head->next) : head; cur != head; cur = list_ptr(cur->next)) {
+        struct Page *node = (struct Page *)cur;
+        if (count == COMPACT_MAX_MAPPINGS) return -1;
+
+        struct AddressSpace *spc = mapping_space(node);
+        uintptr_t va = node_address(node);
+        if (!spc || va >= MAX_USER_ADDRESS) return -1;
+
+        /* Physical addresses of uncached pages and of disk cache
+         * blocks may have been handed to devices for DMA */
+        if (node->state & PROT_CD) return -1;
+        struct Env *env = (void *)((uint8_t *)spc - offsetof(struct Env, address_space));
+        if (in_cache_region(env, va, PAGE_SIZE)) return -1;
+
+        pte_t *pte = compact_pte(spc, va);
+        if (!pte || !(*pte & PTE_P) || PTE_ADDR(*pte) != page2pa(page)) return -1;
+
+        maps[count++] = (struct CompactMapping){
+                .spc = spc,
+                .va = va,
+                .prot = PAGE_PROT(node->state),
+                .bits = *pte & (PTE_A | PTE_D),
+        };
+    }
+
+    return count && count + extra == (int)page->refc ? count : -1;
+}
+
+/* Memory used within the block if all of it can be moved, -1 otherwise */
+static ssize_t
+compact_used(struct Page *node) {
+    if (!node) return 0;
+
+    if (node->refc) {
+        struct CompactMapping maps[COMPACT_MAX_MAPPINGS];
+        return compact_mappings(node, 0, maps) < 0 ? -1 : (ssize_t)CLASS_SIZE(node->class);
+    }
+
+    ssize_t left = compact_used(PAGE_LEFT(node));
+    if (left < 0) return -1;
+    ssize_t right = compact_used(PAGE_RIGHT(node));
+    return right < 0 ? -1 : left + right;
+}
+
+static bool
+compact_move(struct Page *page) {
+    struct CompactMapping maps[COMPACT_MAX_MAPPINGS];
+    /* One reference is inherited from the block */
+    int count = compact_mappings(page, 1, maps);
+    if (count < 0) return 0;
+
+    struct Page *new = alloc_page(0, 0);
+    if (!new) return 0;
+    nosan_memcpy(KADDR(page2pa(new)), KADDR(page2pa(page)), PAGE_SIZE);
+
+    for (int i = 0; i < count; i++) {
+        ensure_free_desc(2 * MAX_CLASS);
+        int res = map_page(maps[i].spc, maps[i].va, new, maps[i].prot);
+        assert(!res);
+
+        /* Dirty bits are used to find blocks to write back */
+        pte_t *pte = compact_pte(maps[i].spc, maps[i].va);
+        assert(pte);
+        *pte |= maps[i].bits;
+    }
+
+    compact_stats.moved++;
+    return 1;
+}
+
+static bool
+compact_move_all(struct Page *node) {
+    if (node->left || node->right)
+        return compact_move_all(PAGE_LEFT(node)) && compact_move_all(PAGE_RIGHT(node));
+    /* Free parts only hold the reference of the block */
+    return node->refc == 1 || compact_move(node);
+}
+
+static bool
+compact_block(struct Page *block) {
+    ssize_t used = compact_used(block);
+    if (used < 0 || used > (ssize_t)COMPACT_MAX_USED) return 0;
+
+    page_ref(block);
+    bool done = free_memory() >= (size_t)used + CLASS_SIZE(POOL_CLASS) && compact_move_all(block);
+    /* Merges the block back if everything was moved */
+    page_unref(block);
+
+    if (done)
+        compact_stats.blocks++;
+    else
+        compact_stats.failed++;
+
+    if (trace_memory) cprintf("Compaction of [%08lX, %08lX] %s\n", (uintptr_t)page2pa(block),
+                              (uintptr_t)(page2pa(block) + CLASS_MASK(COMPACT_CLASS)), done ? "succeeded" : "failed");
+    return done;
+}
+
+/* Compact first suitable 2M block at or above compact_pa */
+static bool
+compact_scan(struct Page *node, size_t *budget) {
+    if (!node || !*budget) return 0;
+    if (page2pa(node) + CLASS_SIZE(node->class) <= compact_pa) return 0;
+    /* Free and allocated as a whole memory needs no compaction */
+    if (node->refc || (!node->left && !node->right)) return 0;
+
+    if (node->class == COMPACT_CLASS) {
+        compact_pa = page2pa(node) + CLASS_SIZE(node->class);
+        (*budget)--;
+        /* Block descriptor might be gone after success */
+        return node->state == ALLOCATABLE_NODE && compact_block(node);
+    }
+
+    if (compact_scan(PAGE_LEFT(node), budget)) return 1;
+    return compact_scan(PAGE_RIGHT(node), budget);
+}
+
+/* Try to free one 2M block looking at no more than budget blocks.
+ * Cached pages can't be moved, so they are given back first if drain is set */
+static bool
+compact_memory(size_t budget, bool drain) {
+    if (compact_active || !current_space) return 0;
+    if (compact_defer) {
+        compact_defer--;
+        return 0;
+    }
+
+    compact_active = 1;
+    compact_stats.runs++;
+    if (drain) drain_page_caches();
+
+    tlb_batch_begin();
+    bool done = compact_scan(&root, &budget);
+    tlb_batch_end();
+
+    /* All memory was looked at, start over after a while */
+    if (!done && budget) {
+        compact_pa = 0;
+        compact_defer = COMPACT_DEFER;
+    }
+
+    compact_active = 0;
+    return done;
+}
+
+static void
+compact_idle(void) {
+    size_t free_blocks = 0;
+    for (int class = COMPACT_CLASS; class < MAX_CLASS && free_blocks < COMPACT_IDLE_TARGET; class ++)
+        free_blocks += free_class_count[class] << (class - COMPACT_CLASS);
+
+    if (free_blocks < COMPACT_IDLE_TARGET) compact_memory(COMPACT_SCAN_BUDGET, 0);
+}
+
+/* Collect memory statistics, env fields describe spc (if not NULL) */
+void
+memstat_read(struct MemStat *stat, struct AddressSpace *spc) {
+    memset(stat, 0, sizeof *stat);
+
+    for (int i = 0; i < MAX_CLASS; i++)
+        stat->free_blocks[i] = free_class_count[i];
+    stat->free_bytes = free_memory();
+
+    for (size_t cpu = 0; cpu < NCPU; cpu++)
+        for (size_t i = 0; i < MAGAZINE_COUNT; i++)
+            stat->cached_bytes += magazines[cpu][i].count * CLASS_SIZE(magazines[cpu][i].class);
+    for (size_t i = 0; i < ZERO_POOL_COUNT; i++)
+        stat->cached_bytes += zero_pools[i].count * CLASS_SIZE(zero_pools[i].class);
+    stat->slab_bytes = kmem_pages() * PAGE_SIZE;
+
+    size_t npools;
+    stat->desc_total = count_descriptors(&npools);
+    stat->desc_free = free_desc_count;
+    stat->desc_pools = npools;
+
+    for (size_t i = 0; i < MEMSTAT_FAULT_CLASSES; i++) {
+        stat->cow_faults[i] = fault_stats.cow[i];
+        stat->zero_faults[i] = fault_stats.zero[i];
+        stat->reuse_faults[i] = fault_stats.reuse[i];
+    }
+    stat->oom_faults = fault_stats.oom;
+    stat->teardown_pending = teardown_stats.queued - teardown_stats.done;
+    stat->teardown_done = teardown_stats.done;
+    stat->teardown_release_cycles = teardown_stats.release_cycles;
+    stat->teardown_work_cycles = teardown_stats.work_cycles;
+    stat->teardown_wait_cycles = teardown_stats.wait_cycles;
+    stat->reclaim_runs = reclaim_stats.runs;
+    stat->reclaimed_bytes = reclaim_stats.freed;
+    stat->pt_shared = shared_pt_stats.shared;
+    stat->pt_copied = shared_pt_stats.copied;
+    stat->pt_adopted = shared_pt_stats.adopted;
+    stat->thp_scanned = thp_stats.scanned;
+    stat->thp_collapsed = thp_stats.collapsed;
+    stat->thp_nomem = thp_stats.nomem;
+    stat->ksm_scanned = ksm_stats.scanned;
+    stat->ksm_merged = ksm_stats.merged;
+    stat->ksm_zero = ksm_stats.zero;
+    stat->ksm_saved_bytes = ksm_saved_bytes();
+    stat->compact_runs = compact_stats.runs;
+    stat->compact_blocks = compact_stats.blocks;
+    stat->compact_moved = compact_stats.moved;
+    stat->compact_failed = compact_stats.failed;
+
+    if (spc) {
+        stat->env_resident = spc->resident;
+        stat->env_shared = spc->shared;
+    }
+}
+
+void
+dump_memstat(void) {
+    struct MemStat stat;
+    memstat_read(&stat, NULL);
+
+    cprintf("Memory: %lluK free, %lluK cached, %lluK slab\n",
+            (unsigned long long)stat.free_bytes / KB,
+            (unsigned long long)stat.cached_bytes / KB,
+            (unsigned long long)stat.slab_bytes / KB);
+    for (int i = 0; i < MAX_CLASS; i++) {
+        if (stat.free_blocks[i])
+            cprintf("  class %2d (%9lluK): %llu free\n", i, CLASS_SIZE(i) / KB,
+                    (unsigned long long)stat.free_blocks[i]);
+    }
+    cprintf("Descriptors: %llu total, %llu free, %llu pools\n",
+            (unsigned long long)stat.desc_total, (unsigned long long)stat.desc_free,
+            (unsigned long long)stat.desc_pools);
+
+    cprintf("Teardown: %llu pending, %llu done, release %llu cycles, %llu cycles of work and %llu cycles since queueing per space\n",
+            (unsigned long long)stat.teardown_pending, (unsigned long long)stat.teardown_done,
+            (unsigned long long)(stat.teardown_release_cycles / MAX(stat.teardown_pending + stat.teardown_done, 1)),
+            (unsigned long long)(stat.teardown_work_cycles / MAX(stat.teardown_done, 1)),
+            (unsigned long long)(stat.teardown_wait_cycles / MAX(stat.teardown_done, 1)));
+    cprintf("Reclaim: %llu runs, %lluK freed\n", (unsigned long long)stat.reclaim_runs,
+            (unsigned long long)stat.reclaimed_bytes / KB);
+    for (struct Shrinker *shrinker = shrinkers; shrinker; shrinker = shrinker->next)
+        cprintf("  %-10s calls=%zu freed=%zuK\n", shrinker->name, shrinker->calls, (size_t)(shrinker->freed / KB));
+
+    cprintf("Shared page tables: %llu shared on fork, %llu copied, %llu taken over\n",
+            (unsigned long long)stat.pt_shared, (unsigned long long)stat.pt_copied,
+            (unsigned long long)stat.pt_adopted);
+    cprintf("Same-page merging: %zu passes, %llu pages scanned, %llu merged, %llu zero, %lluK saved\n",
+            ksm_stats.passes, (unsigned long long)stat.ksm_scanned, (unsigned long long)stat.ksm_merged,
+            (unsigned long long)stat.ksm_zero, (unsigned long long)stat.ksm_saved_bytes / KB);
+    cprintf("Compaction: %llu runs, %llu 2M blocks freed, %llu pages moved, %llu blocks failed\n",
+            (unsigned long long)stat.compact_runs, (unsigned long long)stat.compact_blocks,
+            (unsigned long long)stat.compact_moved, (unsigned long long)stat.compact_failed);
+    cprintf("Faults: %llu out of memory\n", (unsigned long long)stat.oom_faults);
+    for (int i = 0; i < MEMSTAT_FAULT_CLASSES; i++) {
+        if (stat.cow_faults[i] || stat.zero_faults[i] || stat.reuse_faults[i])
+            cprintf("  %s%4lluK: cow=%llu zero=%llu reuse=%llu\n",
+                    i == MEMSTAT_HUGE_CLASS ? ">=" : "  ", CLASS_SIZE(i) / KB,
+                    (unsigned long long)stat.cow_faults[i],
+                    (unsigned long long)stat.zero_faults[i],
+                    (unsigned long long)stat.reuse_faults[i]);
+    }
+
+    for (size_t i = 0; i < NENV; i++) {
+        if (envs[i].env_status == ENV_FREE) continue;
+        cprintf("Env %08x: %zuK resident, %zuK shared\n", envs[i].env_id,
+                (size_t)(envs[i].address_space.resident / KB), (size_t)(envs[i].address_space.shared / KB));
+    }
 }
 
 
+
 /*
  * This function is used for switch address spaces
  *
@@ -1589,7 +3912,26 @@ switch_address_space(struct AddressSpace *space) {
         return current_space;
     }
     struct AddressSpace *old_space = current_space;
-    lcr3(space->cr3);
+    if (space != &kspace && space->pml4_gen != kernel_pml4_gen)
+        copy_kernel_pml4(space);
+    if (!pcid_enabled) {
+        lcr3(space->cr3);
+    } else if (space->pcid_gen == pcid_generation) {
+        /* TLB entries tagged with this PCID are still valid */
+        lcr3(space->cr3 | space->pcid | CR3_NOFLUSH);
+    } else {
+        if (space != &kspace) {
+            if (pcid_next == PCID_COUNT) {
+                pcid_next = 1;
+                pcid_generation++;
+            }
+            space->pcid = pcid_next++;
+        }
+        /* Loading CR3 without NOFLUSH drops whatever
+         * was cached with the previous owner of the PCID */
+        lcr3(space->cr3 | space->pcid);
+        space->pcid_gen = pcid_generation;
+    }
     current_space = space;
     return old_space;
 }
@@ -1602,9 +3944,12 @@ init_address_space(struct AddressSpace *space) {
     int res;
     pte_t pte = 0;
     res = alloc_pt(&pte);
-    assert(!res);
+    if (res < 0) return res;
     pte = PTE_ADDR(pte);
     space->cr3 = pte;
+    space->pcid = 0;
+    space->pcid_gen = 0;
+    space->resident = space->shared = 0;
 
     /* Put its kernel virtual address to space->pml4 */
     // LAB 8: Your code here
@@ -1619,8 +3964,8 @@ init_address_space(struct AddressSpace *space) {
     // LAB 8: Your code here
     space->pml4[PML4_INDEX(UVPT)] = space->cr3 | PTE_P | PTE_U;
 
-    /* Why this call is required here and what does it do? */
-    propagate_one_pml4(space, &kspace);
+    /* Kernel half points to shared PDPTs of kspace */
+    copy_kernel_pml4(space);
     return 0;
 }
 
@@ -1723,8 +4068,10 @@ init_allocator(void) {
     metaheaptop = KERN_HEAP_START + ROUNDUP(uefi_lp->FrameBufferSize, PAGE_SIZE);
 
     /* Initialize lists */
-    for (size_t i = 0; i < MAX_CLASS; i++)
-        list_init(&free_classes[i]);
+    for (size_t i = 0; i < MAX_CLASS; i++) {
+        list_init(&free_classes[FREE_LOW][i]);
+        list_init(&free_classes[FREE_HIGH][i]);
+    }
 
     /* Initialize first pool */
 
@@ -1737,7 +4084,7 @@ init_allocator(void) {
         list_append(&free_descriptors, (struct List *)&initial_buffer[i]);
 
     list_init(&root.head);
-    root.class = MAX_CLASS;
+    root.class = MAX_PHYS_CLASS;
     root.state = PARTIAL_NODE;
 
     /* Query the presence of the utilized features.
@@ -1747,8 +4094,39 @@ init_allocator(void) {
     cpuid(0x80000001, NULL, NULL, NULL, &edx);
     has_1gb_pages = edx & (1 << 26);
     nx_supported = edx & (1 << 20);
+
+    uint32_t maxleaf, ebx, ecx;
+    cpuid(0, &maxleaf, NULL, NULL, NULL);
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    has_pcid = ecx & (1 << 17);
+    if (maxleaf >= 7) {
+        cpuid_count(7, 0, NULL, &ebx, NULL, NULL);
+        has_invpcid = has_pcid && (ebx & (1 << 10));
+    }
     if (trace_init)
-        cprintf("CPUID: 1GB pages: %d, NX: %d\n", has_1gb_pages, nx_supported);
+        cprintf("CPUID: 1GB pages: %d, NX: %d, PCID: %d, INVPCID: %d\n",
+                has_1gb_pages, nx_supported, has_pcid, has_invpcid);
+}
+
+/* Allocate physically contiguous block of given class
+ * for kernel use, it is accessed through physical memory mapping */
+void *
+kalloc_pages(int class) {
+    struct Page *page = alloc_page(class, 0);
+    if (!page) return NULL;
+
+    page_ref(page);
+#ifdef SANITIZE_SHADOW_BASE
+    platform_asan_unpoison(KADDR(page2pa(page)), CLASS_SIZE(class));
+#endif
+    return KADDR(page2pa(page));
+}
+
+void
+kfree_pages(void *va, int class) {
+    struct Page *page = page_lookup(NULL, PADDR(va), class, PARTIAL_NODE, 0);
+    assert(page && page->class == class && page->refc);
+    page_unref(page);
 }
 
 void *
@@ -1814,6 +4192,8 @@ init_kspace(void) {
     memset(kspace.pml4, 0, CLASS_SIZE(0));
     kspace.pml4[PML4_INDEX(UVPT)] = kspace.cr3 | PTE_P | PTE_U;
     kspace.root = alloc_descriptor(INTERMEDIATE_NODE);
+    if (share_kernel_pml4() < 0)
+        panic("Out of memory for kernel PDPTs");
 }
 
 #ifdef SANITIZE_SHADOW_BASE
@@ -1826,8 +4206,8 @@ unpoison_meta(struct Page *node) {
             return;
         }
 
-        if (node->left) unpoison_meta(node->left);
-        node = node->right;
+        if (node->left) unpoison_meta(PAGE_LEFT(node));
+        node = PAGE_RIGHT(node);
     }
 }
 
@@ -1865,6 +4245,41 @@ init_shadow_pre(void) {
 }
 #endif
 
+/*
+ * Measure average alloc_page() cost for the smallest blocks
+ * with and without ALLOC_BOOTMEM. It should stay the same
+ * regardless of the amount of physical memory (QEMU -m).
+ */
+static void
+bench_alloc_page(void) {
+    enum { BENCH_PAGES = 256 };
+    static struct Page *pages[BENCH_PAGES];
+
+    for (int bootmem = 0; bootmem < 2; bootmem++) {
+        uint64_t cycles = 0;
+        size_t count = 0;
+
+        for (; count < BENCH_PAGES; count++) {
+            /* Keep descriptor pool refills out of measurements */
+            ensure_free_desc((MAX_CLASS + 1) * 2);
+
+            uint64_t start = read_tsc();
+            struct Page *page = alloc_page(0, bootmem ? ALLOC_BOOTMEM : 0);
+            cycles += read_tsc() - start;
+
+            if (!page) break;
+            page_ref(page);
+            pages[count] = page;
+        }
+
+        cprintf("alloc_page: %lu cycles per page%s, memory size %zuM\n",
+                (unsigned long)(count ? cycles / count : 0),
+                bootmem ? " (ALLOC_BOOTMEM)" : "", (size_t)(max_memory_map_addr / MB));
+
+        while (count) page_unref(pages[--count]);
+    }
+}
+
 void
 init_memory(void) {
     int res = -1;
@@ -1876,6 +4291,11 @@ init_memory(void) {
     check_physical_tree(&root);
     if (trace_init) cprintf("Physical memory tree is correct\n");
 
+    if (bench_memory) {
+        bench_alloc_page();
+        check_physical_tree(&root);
+    }
+
     init_kspace();
 
     /* First, only map kernel itself, kernel stacks, UEFI memory
@@ -1960,6 +4380,14 @@ init_memory(void) {
 
     switch_address_space(&kspace);
 
+    /* PCIDE can only be set while PCID 0 is loaded into CR3,
+     * and kspace always uses PCID 0 */
+    if (has_pcid) {
+        lcr4(rcr4() | CR4_PCIDE);
+        kspace.pcid_gen = pcid_generation;
+        pcid_enabled = 1;
+    }
+
     /* One page is a page filled with 0xFF values -- ASAN poison */
     nosan_memset(one_page_raw, 0xFF, CLASS_SIZE(MAX_ALLOCATION_CLASS));
 
@@ -2034,6 +4462,9 @@ init_memory(void) {
 
     check_virtual_tree(kspace.root, MAX_CLASS);
     if (trace_init) cprintf("Kernel virtual memory tree is correct\n");
+
+    for (size_t i = 0; i < sizeof(builtin_shrinkers) / sizeof(*builtin_shrinkers); i++)
+        register_shrinker(&builtin_shrinkers[i]);
 }
 
 static uintptr_t user_mem_check_addr;
@@ -2057,10 +4488,10 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm) {
     // LAB 8: Your code here
     const void *cur_page = (void *)ROUNDDOWN(va, PAGE_SIZE);
     const void *end = va + len;
-    struct Page *root = env->address_space.root;
     while (cur_page < end) {
-        struct Page *page = page_lookup_virtual(root, (uintptr_t)cur_page, 0, 0);
-        if (!page->phy || (page->state & PAGE_PROT(perm)) != PAGE_PROT(perm)) {
+        int nshared;
+        struct Page *page = page_peek_virtual(&env->address_space, (uintptr_t)cur_page, 0, &nshared);
+        if (!page || !page->phy || (page->state & PAGE_PROT(perm)) != PAGE_PROT(perm)) {
             user_mem_check_addr = (uintptr_t)(MAX(va, cur_page));
             return -E_FAULT;
         }
@@ -9,6 +9,7 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 #include <inc/env.h>
+#include <inc/memstat.h>
 #include <inc/x86.h>
 
 #define CLASS_BASE    12
@@ -34,6 +35,8 @@ void __nosan_memmove(void *, void *, size_t);
 #endif
 
 #define MAX_CLASS 48
+/* Physical memory tree root class (52-bit physical addresses) */
+#define MAX_PHYS_CLASS 40
 
 #define POOL_ENTRIES_FOR_SIZE(sz) (((sz)-offsetof(struct PagePool, data)) / sizeof(struct Page))
 
@@ -45,11 +48,21 @@ void __nosan_memmove(void *, void *, size_t);
 #define PAGE_PROT(p) ((p) & ~NODE_TYPE_MASK)
 
 /* map_region() source override flags */
-#define ALLOC_ZERO 0x100000 /* Allocate memory filled with 0x00 */
-#define ALLOC_ONE  0x200000 /* Allocate memory filled with 0xFF */
+#define ALLOC_ZERO     0x100000  /* Allocate memory filled with 0x00 */
+#define ALLOC_ONE      0x200000  /* Allocate memory filled with 0xFF */
+#define ALLOC_POPULATE 0x800000  /* Allocate memory right away instead of lazily */
+#define ALLOC_HUGE     0x1000000 /* Back 2M/1G-aligned parts with huge pages right away */
 /* map_physical_region() behaviour flags */
 #define MAP_USER_MMIO 0x400000 /* Disallow multiple use and be stricter */
 
+/* sys_region_advise() advice */
+#define ADVISE_NORMAL     0 /* Default fault-around */
+#define ADVISE_RANDOM     1 /* Disable fault-around */
+#define ADVISE_SEQUENTIAL 2 /* Maximal fault-around */
+#define ADVISE_WILLNEED   3 /* Allocate lazily mapped memory now */
+#define ADVISE_DONTNEED   4 /* Drop memory, leaving it zero-filled */
+#define ADVISE_FREE       5 /* Allow dropping memory until it is written */
+
 /* Memory protection flags & attributes */
 #define PROT_X       0x1 /* Executable */
 #define PROT_W       0x2 /* Writable */
@@ -71,33 +84,48 @@ void __nosan_memmove(void *, void *, size_t);
 enum PageState {
     MAPPING_NODE = 0x100000,      /* Memory mapping (part of virtual tree) */
     INTERMEDIATE_NODE = 0x200000, /* Intermediate node of virtual memory tree */
-    PARTIAL_NODE = 0x300000,      /* Intermediate node of physical memory tree */
-    ALLOCATABLE_NODE = 0x400000,  /* Generic allocatable memory (part of physical tree) */
-    RESERVED_NODE = 0x500000,     /* Reserved memory (part of physical tree) */
+    SHARED_NODE = 0x300000,       /* Virtual subtree shared by several address spaces after fork */
+    PARTIAL_NODE = 0x400000,      /* Intermediate node of physical memory tree */
+    ALLOCATABLE_NODE = 0x500000,  /* Generic allocatable memory (part of physical tree) */
+    RESERVED_NODE = 0x600000,     /* Reserved memory (part of physical tree) */
     NODE_TYPE_MASK = 0xF00000,
 };
 
 extern __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t zero_page_raw[HUGE_PAGE_SIZE];
 extern __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t one_page_raw[HUGE_PAGE_SIZE];
 
+/* Descriptors reference each other with 32-bit offsets from KERN_BASE_ADDR
+ * instead of pointers. Every descriptor is located either in the kernel image
+ * or in descriptor pools, which are allocated within BOOT_MEM_SIZE,
+ * so the offsets always fit. Zero offset is used as NULL */
+typedef uint32_t page_link_t;
+
+static_assert(BOOT_MEM_SIZE <= 4 * 1024 * 1024 * 1024ULL, "Descriptor links should fit in 32 bits");
+
+#define PAGE_REFC_MAX ((1U << 24) - 1)
+
 struct Page {
     struct List head; /* This should be first member */
-    struct Page *left, *right, *parent;
-    enum PageState state;
+    page_link_t left, right, parent;
+    uint32_t state : 24; /* enum PageState */
+    uint32_t class : 8;  /* = log2(size)-CLASS_BASE (physical page only) */
     union {
         struct /* physical page */ {
             /* Number of references
              * Child nodes always have class
              * smaller by 1 than their parents */
-            uint32_t refc;
-            uintptr_t class : CLASS_BASE;                        /* = log2(size)-CLASS_BASE */
-            uintptr_t addr : sizeof(uintptr_t) * 8 - CLASS_BASE; /* = address >> CLASS_BASE */
+            uint64_t refc : 24;
+            uint64_t addr : 40; /* = address >> CLASS_BASE */
+        };
+        struct /* mapping */ {
+            page_link_t phy;     /* If phy == 0 this is intemediate page */
+            page_link_t subtree; /* Shared subtree holder (SHARED_NODE only) */
         };
-        /* mapping */
-        struct Page *phy; /* If phy == NULL this is intemediate page */
     };
 };
 
+static_assert(sizeof(struct Page) == 32, "Two descriptors should share a cache line");
+
 struct PagePool {
     struct Page *peer;     /* Page from which memory is taken */
     struct PagePool *next; /* Next pool link */
@@ -114,11 +142,38 @@ int init_address_space(struct AddressSpace *space);
 void user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 int region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size);
 int force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass);
+void fault_around(struct AddressSpace *spc, uintptr_t va);
+int advise_region(struct AddressSpace *spc, uintptr_t va, size_t size, int advice);
 void dump_page_table(pte_t *pml4);
 void dump_memory_lists(void);
+void dump_page_caches(void);
+void dump_tlb_stats(void);
+void dump_thp_stats(void);
+void dump_memstat(void);
+void memstat_read(struct MemStat *stat, struct AddressSpace *spc);
+
+/* Memory reclaim callback, called when memory runs out */
+struct Shrinker {
+    const char *name;
+    void (*shrink)(size_t target); /* Try to free target bytes */
+
+    size_t calls, freed;
+    struct Shrinker *next;
+};
+
+void register_shrinker(struct Shrinker *shrinker);
+size_t reclaim_memory(size_t target);
+bool pmap_idle(void);
+bool pmap_idle_pending(void);
+bool pmap_tick(void);
+bool pmap_tick_pending(void);
+void thp_wake(void);
+void ksm_wake(void);
 void dump_virtual_tree(struct Page *node, int class);
 
 void *kzalloc_region(size_t size);
+void *kalloc_pages(int class);
+void kfree_pages(void *va, int class);
 
 void *mmio_map_region(physaddr_t addr, size_t size);
 void *mmio_remap_last_region(physaddr_t addr, void *oldva, size_t oldsz, size_t size);
@@ -166,9 +221,24 @@ _kaddr(const char *file, int line, physaddr_t pa) {
 
 inline static physaddr_t __attribute__((always_inline))
 page2pa(struct Page *page) {
-    return page->addr << CLASS_BASE;
+    return (physaddr_t)page->addr << CLASS_BASE;
+}
+
+inline static struct Page *__attribute__((always_inline))
+link2page(page_link_t link) {
+    return link ? (struct Page *)(KERN_BASE_ADDR + (uintptr_t)link) : NULL;
 }
 
+inline static page_link_t __attribute__((always_inline))
+page2link(struct Page *page) {
+    return page ? (page_link_t)((uintptr_t)page - KERN_BASE_ADDR) : 0;
+}
+
+#define PAGE_LEFT(p)   link2page((p)->left)
+#define PAGE_RIGHT(p)  link2page((p)->right)
+#define PAGE_PARENT(p) link2page((p)->parent)
+#define PAGE_PHY(p)    link2page((p)->phy)
+
 inline static void
 set_wp(bool wp) {
     uintptr_t old = rcr0();
@@ -2,19 +2,362 @@
 #include <inc/x86.h>
 #include <kern/env.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/timer.h>
 
 
 struct Taskstate cpu_ts;
 _Noreturn void sched_halt(void);
 
+/* Multilevel feedback queue.
+ * Level 0 has the highest priority. Env starts at the level of its
+ * base priority (env_priority), goes one level down after using up
+ * the time slice of its level and one level up (not above base)
+ * each time it blocks in sys_ipc_recv(). Every SCHED_BOOST_TICKS
+ * ticks all runnable envs are returned to their base levels,
+ * so CPU-bound envs are not starved forever. */
+#define SCHED_BOOST_TICKS 32
+/* Timer tick length, timer is only kept running while
+ * somebody is waiting for CPU, so idle and single env
+ * run without interrupts (tickless) */
+#define SCHED_TICK_NS 500000000ULL
+/* Timer interval for background work while CPU is idle */
+#define SCHED_IDLE_NS 10000000ULL
+/* Time slice of level in timer ticks */
+#define SCHED_SLICE(level) (1U << (level))
+/* Levels above the fair class */
+#define SCHED_UPPER_MASK ((1U << (SCHED_LEVELS - 1)) - 1)
+
+/* Runnable environments of each level in the order they are going to run.
+ * Env is on a queue iff its status is ENV_RUNNABLE,
+ * so env_status should only be changed with env_set_status() */
+static struct RunQueue {
+    struct Env *head, *tail;
+} run_queue[SCHED_LEVELS];
+/* Bit N is set iff run_queue[N] is not empty */
+static uint32_t run_queue_mask;
+
+static uint64_t sched_ticks;
+
+/* Fair class.
+ * Envs with non-zero env_weight are charged virtual runtime,
+ * which is TSC cycles spent in user mode scaled by
+ * SCHED_WEIGHT_DEFAULT / env_weight, and the one with the least
+ * virtual runtime runs next. Fair class goes after all MLFQ levels
+ * except the lowest one, so it is not starved by demoted CPU hogs
+ * and does not starve interactive envs.
+ * Runnable fair envs are kept in a binary min-heap keyed by vruntime. */
+static struct Env *fair_heap[NENV];
+static size_t fair_heap_size;
+/* Lower bound for vruntime of runnable fair envs, it only grows.
+ * Envs waking up or joining the class start from here */
+static uint64_t fair_min_vruntime;
+
+/* TSC value at the last switch between user and kernel mode */
+static uint64_t sched_stamp;
+/* curenv is running in user mode */
+static bool sched_in_user;
+/* Env kernel is working for, it is charged with kernel time */
+static struct Env *sched_kernel_env;
+/* Context switch is caused by timer */
+static bool sched_preempting;
+
+static void
+fair_heap_place(size_t i, struct Env *env) {
+    fair_heap[i] = env;
+    env->env_heap_index = i;
+}
+
+static void
+fair_heap_up(size_t i) {
+    struct Env *env = fair_heap[i];
+    while (i) {
+        size_t parent = (i - 1) / 2;
+        if (fair_heap[parent]->env_vruntime <= env->env_vruntime) break;
+        fair_heap_place(i, fair_heap[parent]);
+        i = parent;
+    }
+    fair_heap_place(i, env);
+}
+
+static void
+fair_heap_down(size_t i) {
+    struct Env *env = fair_heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= fair_heap_size) break;
+        if (child + 1 < fair_heap_size &&
+            fair_heap[child + 1]->env_vruntime < fair_heap[child]->env_vruntime) child++;
+        if (env->env_vruntime <= fair_heap[child]->env_vruntime) break;
+        fair_heap_place(i, fair_heap[child]);
+        i = child;
+    }
+    fair_heap_place(i, env);
+}
+
+static void
+fair_heap_push(struct Env *env) {
+    env->env_vruntime = MAX(env->env_vruntime, fair_min_vruntime);
+    fair_heap_place(fair_heap_size++, env);
+    fair_heap_up(env->env_heap_index);
+}
+
+static void
+fair_heap_remove(struct Env *env) {
+    size_t i = env->env_heap_index;
+    struct Env *last = fair_heap[--fair_heap_size];
+    if (i != fair_heap_size) {
+        fair_heap_place(i, last);
+        fair_heap_up(i);
+        fair_heap_down(last->env_heap_index);
+    }
+}
+
+static void
+level_queue_push(struct Env *env) {
+    struct RunQueue *queue = &run_queue[env->env_sched_level];
+    env->env_rq_next = NULL;
+    env->env_rq_prev = queue->tail;
+    if (queue->tail)
+        queue->tail->env_rq_next = env;
+    else
+        queue->head = env;
+    queue->tail = env;
+    run_queue_mask |= 1U << env->env_sched_level;
+}
+
+static void
+level_queue_remove(struct Env *env) {
+    struct RunQueue *queue = &run_queue[env->env_sched_level];
+    if (env->env_rq_prev)
+        env->env_rq_prev->env_rq_next = env->env_rq_next;
+    else
+        queue->head = env->env_rq_next;
+    if (env->env_rq_next)
+        env->env_rq_next->env_rq_prev = env->env_rq_prev;
+    else
+        queue->tail = env->env_rq_prev;
+    env->env_rq_next = env->env_rq_prev = NULL;
+    if (!queue->head) run_queue_mask &= ~(1U << env->env_sched_level);
+}
+
+static void
+run_queue_push(struct Env *env) {
+    if (env->env_weight)
+        fair_heap_push(env);
+    else
+        level_queue_push(env);
+}
+
+static void
+run_queue_remove(struct Env *env) {
+    if (env->env_weight)
+        fair_heap_remove(env);
+    else
+        level_queue_remove(env);
+}
+
+/* Highest priority runnable env (NULL if there are none) */
+static struct Env *
+run_queue_first(void) {
+    if (run_queue_mask & SCHED_UPPER_MASK)
+        return run_queue[__builtin_ctz(run_queue_mask)].head;
+    if (fair_heap_size) return fair_heap[0];
+    return run_queue[SCHED_LEVELS - 1].head;
+}
+
+/* Change env status keeping run queues up to date.
+ * Envs becoming runnable are queued behind all other
+ * runnable envs of the same level */
+void
+env_set_status(struct Env *env, unsigned status) {
+    if (env->env_status == ENV_RUNNABLE && status != ENV_RUNNABLE)
+        run_queue_remove(env);
+    else if (env->env_status != ENV_RUNNABLE && status == ENV_RUNNABLE)
+        run_queue_push(env);
+    env->env_status = status;
+}
+
+/* Move env to another level, it gets a fresh time slice there */
+static void
+env_set_level(struct Env *env, unsigned level) {
+    bool queued = env->env_status == ENV_RUNNABLE;
+    if (queued) run_queue_remove(env);
+    env->env_sched_level = level;
+    env->env_sched_ticks = 0;
+    if (queued) run_queue_push(env);
+}
+
+/* Set base priority of env and move it to the corresponding level */
+void
+env_set_priority(struct Env *env, unsigned priority) {
+    assert(priority < SCHED_LEVELS);
+    env->env_priority = priority;
+    env_set_level(env, priority);
+}
+
+/* Move env to the fair class with given weight
+ * or back to MLFQ if weight is 0 */
+void
+env_set_weight(struct Env *env, unsigned weight) {
+    assert(weight <= SCHED_WEIGHT_MAX);
+    bool queued = env->env_status == ENV_RUNNABLE;
+    if (queued) run_queue_remove(env);
+    if (!env->env_weight) env->env_vruntime = fair_min_vruntime;
+    env->env_weight = weight;
+    if (queued) run_queue_push(env);
+}
+
+/* Charge the env kernel has been working for with kernel time until now */
+static void
+sched_charge_kernel(uint64_t now) {
+    if (sched_kernel_env) sched_kernel_env->env_kernel_cycles += now - sched_stamp;
+    sched_kernel_env = NULL;
+    sched_stamp = now;
+}
+
+/* Called on entry to trap(), charges curenv for
+ * the time it has spent in user mode since the last
+ * sched_leave_kernel(). Kernel time from here on is charged
+ * to curenv too. Returns true if trap came from user mode */
+bool
+sched_enter_kernel(void) {
+    /* Nested traps are a part of the outer one */
+    if (!sched_in_user) return 0;
+    sched_in_user = 0;
+
+    uint64_t now = read_tsc();
+    struct Env *env = curenv;
+    uint64_t cycles = now - sched_stamp;
+    env->env_user_cycles += cycles;
+    if (env->env_weight)
+        env->env_vruntime += cycles * SCHED_WEIGHT_DEFAULT / env->env_weight;
+
+    sched_kernel_env = env;
+    sched_stamp = now;
+    return 1;
+}
+
+/* Do background memory work, its time is charged to nobody
+ * instead of the env kernel has been working for */
+static bool
+sched_background(bool (*work)(void)) {
+    struct Env *env = sched_kernel_env;
+    sched_charge_kernel(read_tsc());
+    bool more = work();
+    sched_stamp = read_tsc();
+    sched_kernel_env = env;
+    return more;
+}
+
+/* Called right before returning to curenv */
+void
+sched_leave_kernel(void) {
+    struct Env *env = curenv;
+    if (env->env_weight) {
+        uint64_t min = env->env_vruntime;
+        if (fair_heap_size) min = MIN(min, fair_heap[0]->env_vruntime);
+        fair_min_vruntime = MAX(fair_min_vruntime, min);
+    }
+
+    /* Timer is only needed to preempt curenv for somebody else
+     * or to do background memory management work */
+    if (run_queue_first() || pmap_tick_pending())
+        clockevent_program(SCHED_TICK_NS);
+    else
+        clockevent_stop();
+
+    sched_charge_kernel(read_tsc());
+    sched_in_user = 1;
+}
+
+/* Called by env_run() when env stops running */
+void
+sched_switch_out(struct Env *env) {
+    if (sched_preempting)
+        env->env_involuntary_switches++;
+    else if (env->env_status != ENV_FREE)
+        env->env_voluntary_switches++;
+    sched_preempting = 0;
+}
+
+/* Switch away from curenv because of timer */
+static _Noreturn void
+sched_preempt(void) {
+    sched_preempting = 1;
+    sched_yield();
+}
+
+/* Env is going to block waiting for IPC, so it is likely interactive */
+void
+sched_boost(struct Env *env) {
+    if (env->env_sched_level > env->env_priority)
+        env_set_level(env, env->env_sched_level - 1);
+}
+
+/* Return every runnable env to its base level */
+static void
+sched_boost_all(void) {
+    for (unsigned level = 1; level < SCHED_LEVELS; level++) {
+        struct Env *next;
+        /* Envs are only moved to upper levels here */
+        for (struct Env *env = run_queue[level].head; env; env = next) {
+            next = env->env_rq_next;
+            if (env->env_priority < level) env_set_level(env, env->env_priority);
+        }
+    }
+    if (curenv && curenv->env_sched_level != curenv->env_priority)
+        env_set_level(curenv, curenv->env_priority);
+}
+
+/* Timer interrupt: do a bit of background memory work,
+ * charge the running env one tick and
+ * preempt it if its time slice is used up or if a higher
+ * priority env became runnable. Returns if curenv should
+ * continue running (or there is no curenv) */
+void
+sched_tick(void) {
+    sched_background(pmap_tick);
+
+    if (++sched_ticks % SCHED_BOOST_TICKS == 0) sched_boost_all();
+
+    struct Env *env = curenv;
+    if (!env || env->env_status != ENV_RUNNING) return;
+
+    /* Fair env has already been charged on kernel entry,
+     * it gives way to the env with less virtual runtime */
+    if (env->env_weight) {
+        if (run_queue_mask & SCHED_UPPER_MASK ||
+            (fair_heap_size && fair_heap[0]->env_vruntime < env->env_vruntime))
+            sched_preempt();
+        return;
+    }
+
+    /* Preempt for envs of higher priority or, when time slice
+     * is used up, for envs of the same priority as well */
+    uint32_t preempt = (1U << env->env_sched_level) - 1;
+    if (++env->env_sched_ticks >= SCHED_SLICE(env->env_sched_level)) {
+        if (env->env_sched_level < SCHED_LEVELS - 1)
+            env_set_level(env, env->env_sched_level + 1);
+        else
+            env->env_sched_ticks = 0;
+        preempt = (2U << env->env_sched_level) - 1;
+    }
+
+    if (run_queue_mask & preempt) sched_preempt();
+    /* Lowest level goes after fair class */
+    if (env->env_sched_level == SCHED_LEVELS - 1 && fair_heap_size) sched_preempt();
+}
+
 /* Choose a user environment to run and run it */
 _Noreturn void
 sched_yield(void) {
-    /* Implement simple round-robin scheduling.
-     *
-     * Search through 'envs' for an ENV_RUNNABLE environment in
-     * circular fashion starting just after the env was
-     * last running.  Switch to the first such environment found.
+    /* Run the highest priority runnable environment.
+     * env_run() puts the previously running environment
+     * at the tail of its level, so envs of the same level
+     * take turns. Yielding env gives way even to lower priority
+     * envs, they run until the next tick at most.
      *
      * If no envs are runnable, but the environment previously
      * running is still ENV_RUNNING, it's okay to
@@ -24,21 +367,14 @@ sched_yield(void) {
      * simply drop through to the code
      * below to halt the cpu */
 
-    // LAB 3: Your code here:
-    int current_id = curenv ? ENVX(curenv->env_id) : 0;
-    int parent_id = current_id;
-	while (1) {
-		current_id = (current_id + 1) % NENV;
-		if (envs[current_id].env_status == ENV_RUNNABLE) {
-			env_run(&envs[current_id]);
-		}
-		if (parent_id == current_id) {
-			if (envs[current_id].env_status == ENV_RUNNING) {
-				env_run(&envs[current_id]);
-			}
-			break;
-		}
-	}
+    struct Env *next = run_queue_first();
+    if (next)
+        env_run(next);
+    if (curenv && curenv->env_status == ENV_RUNNING) {
+        /* Nobody else wants CPU, so it is as good as idle */
+        if (pmap_idle_pending()) sched_background(pmap_idle);
+        env_run(curenv);
+    }
 
     cprintf("Halt\n");
 
@@ -47,24 +383,34 @@ sched_yield(void) {
     sched_halt();
 }
 
-/* Halt this CPU when there is nothing to do. Wait until the
- * timer interrupt wakes it up. This function never returns */
+/* Halt this CPU when there is nothing to do. Wait until an
+ * interrupt wakes it up. This function never returns */
 _Noreturn void
 sched_halt(void) {
 
     /* For debugging and testing purposes, if there are no runnable
-     * environments in the system, then drop into the kernel monitor */
-    int i;
-    for (i = 0; i < NENV; i++)
-        if (envs[i].env_status == ENV_RUNNABLE ||
-            envs[i].env_status == ENV_RUNNING) break;
-    if (i == NENV) {
+     * environments in the system, then drop into the kernel monitor.
+     * Nothing can make blocked envs runnable again, so only finish
+     * background memory management work first */
+    if (!run_queue_first() && !(curenv && curenv->env_status == ENV_RUNNING) &&
+        !pmap_idle_pending()) {
+        clockevent_stop();
         cprintf("No runnable environments in the system!\n");
         for (;;) monitor(NULL);
     }
 
-    /* Mark that no environment is running on CPU */
+    /* Mark that no environment is running on CPU,
+     * idle time is not charged to anybody */
     curenv = NULL;
+    sched_charge_kernel(read_tsc());
+
+    /* Use idle time for background memory management work */
+    pmap_idle();
+
+    /* Nothing to preempt, so timer only wakes CPU up
+     * for the next portion of background work */
+    clockevent_stop();
+    clockevent_program(SCHED_IDLE_NS);
 
     /* Reset stack pointer, enable interrupts and then halt */
     asm volatile(
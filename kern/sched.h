@@ -6,6 +6,16 @@
 #error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
 _Noreturn void sched_yield(void);
+void sched_tick(void);
+void sched_boost(struct Env *env);
+void env_set_status(struct Env *env, unsigned status);
+void env_set_priority(struct Env *env, unsigned priority);
+void env_set_weight(struct Env *env, unsigned weight);
+bool sched_enter_kernel(void);
+void sched_leave_kernel(void);
+void sched_switch_out(struct Env *env);
 
 #endif /* !JOS_KERN_SCHED_H */
@@ -0,0 +1,177 @@
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/shm.h>
+
+/*
+ * Shared memory objects.
+ *
+ * Memory of an object is mapped with PROT_SHARE into its own address
+ * space, which is never run, and envs map it from there with
+ * map_region(), so the object and every env reference the same
+ * physical pages. Pages are freed with the last reference: unlinking
+ * the object only drops its own mappings, envs that still map the
+ * memory keep it. Anonymous objects (with empty name) can only be
+ * found by handle, which can be passed to other envs over IPC.
+ * Only the creator of an object and its parent (envs that
+ * envid2env() lets change the creator) can resize or remove it.
+ * Once both of them are gone, the object is removed as well.
+ */
+
+/* Envs can map object memory with any subset of these */
+#define SHM_PROT (PROT_RWX | PROT_USER_ | PROT_SHARE)
+
+static struct Shm shms[NSHM];
+static shmid_t shm_generation;
+
+static struct Shm *
+shm_lookup(shmid_t id) {
+    struct Shm *shm = &shms[SHMX(id)];
+    return id > 0 && shm->id == id ? shm : NULL;
+}
+
+/* Current env may resize or remove the object */
+static bool
+shm_owned(struct Shm *shm) {
+    return curenv && (curenv->env_id == shm->owner || curenv->env_id == shm->owner_parent);
+}
+
+/* Env with given id exists and is not the one being freed */
+static bool
+shm_env_alive(envid_t id, struct Env *dying) {
+    struct Env *env = &envs[ENVX(id)];
+    return id && env != dying && env->env_id == id && env->env_status != ENV_FREE;
+}
+
+static void
+shm_release(struct Shm *shm) {
+    release_address_space(&shm->space);
+    memset(shm, 0, sizeof *shm);
+}
+
+static struct Shm *
+shm_find(const char *name) {
+    for (size_t i = 0; i < NSHM; i++) {
+        if (shms[i].id && !strcmp(shms[i].name, name)) return &shms[i];
+    }
+    return NULL;
+}
+
+/* Open object 'name', creating it with 'size' bytes of zeroes
+ * if it does not exist and SHM_CREATE is set.
+ * Returns handle of the object, < 0 on error. Errors are:
+ *  -E_INVAL if size is not page-aligned or too large, name is too long
+ *      or object exists and SHM_EXCL is set;
+ *  -E_NO_ENT if object does not exist and SHM_CREATE is not set;
+ *  -E_NO_MEM if there are no free objects or memory. */
+int
+shm_open(const char *name, size_t size, int flags) {
+    if (size & CLASS_MASK(0) || size > MAX_USER_ADDRESS) return -E_INVAL;
+    if (strlen(name) > SHM_NAME_MAX) return -E_INVAL;
+
+    struct Shm *shm = name[0] ? shm_find(name) : NULL;
+    if (shm) return flags & SHM_EXCL ? -E_INVAL : shm->id;
+    if (!(flags & SHM_CREATE)) return -E_NO_ENT;
+
+    for (shm = shms; shm < shms + NSHM; shm++)
+        if (!shm->id) break;
+    if (shm == shms + NSHM) return -E_NO_MEM;
+
+    /* Handles stay positive */
+    if (++shm_generation >= 1 << (31 - LOG2NSHM)) shm_generation = 1;
+    shm->id = (shm_generation << LOG2NSHM) | (shmid_t)(shm - shms);
+    strcpy(shm->name, name);
+    shm->size = 0;
+    shm->owner = curenv ? curenv->env_id : 0;
+    shm->owner_parent = curenv ? curenv->env_parent_id : 0;
+
+    int res = init_address_space(&shm->space);
+    if (res < 0) {
+        memset(shm, 0, sizeof *shm);
+        return res;
+    }
+
+    res = shm_resize(shm->id, size);
+    if (res < 0) {
+        shm_unlink(shm->id);
+        return res;
+    }
+
+    return shm->id;
+}
+
+/* Change size of the object. Memory is added filled with zeroes,
+ * memory cut off stays mapped in envs that map it.
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_INVAL if object does not exist or size is invalid;
+ *  -E_BAD_ENV if current env did not create the object
+ *      and is not the parent of its creator;
+ *  -E_NO_MEM if there's no memory to grow the object. */
+int
+shm_resize(shmid_t id, size_t size) {
+    struct Shm *shm = shm_lookup(id);
+    if (!shm || size & CLASS_MASK(0) || size > MAX_USER_ADDRESS) return -E_INVAL;
+    if (!shm_owned(shm)) return -E_BAD_ENV;
+
+    if (size > shm->size) {
+        /* Shared memory is allocated right away */
+        int res = map_region(&shm->space, shm->size, NULL, 0, size - shm->size, SHM_PROT | ALLOC_ZERO);
+        if (res < 0) {
+            unmap_region(&shm->space, shm->size, size - shm->size);
+            return res;
+        }
+    } else if (size < shm->size) {
+        unmap_region(&shm->space, size, shm->size - size);
+    }
+
+    shm->size = size;
+    return 0;
+}
+
+/* Map [offset, offset + size) of the object at 'va' of 'spc'
+ * with protection 'perm' (PROT_RWX and PROT_AVAIL bits).
+ * Any env that knows the handle can map the object, the caller
+ * checks that it may change 'spc'.
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_INVAL if object does not exist, range is not page-aligned
+ *      or not within the object or user space, or perm is invalid;
+ *  -E_NO_MEM if there's no memory for page tables. */
+int
+shm_map(shmid_t id, struct AddressSpace *spc, uintptr_t va, size_t offset, size_t size, int perm) {
+    struct Shm *shm = shm_lookup(id);
+    if (!shm || (va | offset | size) & CLASS_MASK(0) || !size) return -E_INVAL;
+    if (offset > shm->size || size > shm->size - offset) return -E_INVAL;
+    if (va >= MAX_USER_ADDRESS || size > MAX_USER_ADDRESS - va) return -E_INVAL;
+    if (perm & ~(PROT_RWX | PROT_AVAIL)) return -E_INVAL;
+
+    return map_region(spc, va, &shm->space, offset, size, perm | PROT_USER_ | PROT_SHARE);
+}
+
+/* Remove the object. Its memory is freed once no env maps it.
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_INVAL if object does not exist;
+ *  -E_BAD_ENV if current env did not create the object
+ *      and is not the parent of its creator. */
+int
+shm_unlink(shmid_t id) {
+    struct Shm *shm = shm_lookup(id);
+    if (!shm) return -E_INVAL;
+    if (!shm_owned(shm)) return -E_BAD_ENV;
+
+    shm_release(shm);
+    return 0;
+}
+
+/* Called by env_free(): remove objects of env that nobody
+ * is allowed to remove once env is gone */
+void
+shm_env_free(struct Env *env) {
+    for (struct Shm *shm = shms; shm < shms + NSHM; shm++) {
+        if (!shm->id || (shm->owner != env->env_id && shm->owner_parent != env->env_id)) continue;
+        if (!shm_env_alive(shm->owner, env) && !shm_env_alive(shm->owner_parent, env))
+            shm_release(shm);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_SHM_H
+#define JOS_KERN_SHM_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+#include <inc/shm.h>
+
+struct Shm {
+    shmid_t id;                  /* 0 if slot is free */
+    char name[SHM_NAME_MAX + 1]; /* Empty for anonymous objects */
+    size_t size;                 /* Multiple of page size */
+    envid_t owner;               /* Env that created the object */
+    envid_t owner_parent;        /* Its parent, also allowed to change it */
+    struct AddressSpace space;   /* Memory of the object is mapped at [0, size) */
+};
+
+int shm_open(const char *name, size_t size, int flags);
+int shm_resize(shmid_t id, size_t size);
+int shm_map(shmid_t id, struct AddressSpace *spc, uintptr_t va, size_t offset, size_t size, int perm);
+int shm_unlink(shmid_t id);
+void shm_env_free(struct Env *env);
+
+#endif /* !JOS_KERN_SHM_H */
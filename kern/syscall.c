@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/pmap.h>
 #include <kern/sched.h>
+#include <kern/shm.h>
 #include <kern/syscall.h>
 #include <kern/trap.h>
 #include <kern/traceopt.h>
@@ -101,7 +102,9 @@ sys_exofork(void) {
         return errc;
     }
 
-    result->env_status = ENV_NOT_RUNNABLE;
+    env_set_status(result, ENV_NOT_RUNNABLE);
+    env_set_priority(result, curenv->env_priority);
+    env_set_weight(result, curenv->env_weight);
     result->env_tf = curenv->env_tf;
     result->env_tf.tf_regs.reg_rax = 0;
 
@@ -137,7 +140,7 @@ sys_env_set_status(envid_t envid, int status) {
         return -E_INVAL;
     }
 
-    result->env_status = status;
+    env_set_status(result, status);
 
     return 0;
 }
@@ -164,6 +167,239 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func) {
     return 0;
 }
 
+/* Set memory management flags (ENV_MM_*) of 'envid'.
+ * ENV_MM_THP allows kernel to collapse fully populated
+ * 2MB ranges of private memory into huge pages in background.
+ * ENV_MM_KSM allows kernel to merge identical private pages
+ * of all such envs in background, copying them back on write.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if flags contain unknown bits. */
+static int
+sys_env_set_mm_flags(envid_t envid, uint32_t flags) {
+    if (flags & ~ENV_MM_ALL) return -E_INVAL;
+
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, true);
+    if (res < 0) return res;
+
+    env->env_mm_flags = flags;
+    if (flags & ENV_MM_THP) thp_wake();
+    if (flags & ENV_MM_KSM) ksm_wake();
+    return 0;
+}
+
+/* Register [va, va + size) as cache region of 'envid'.
+ * Under memory pressure kernel may unmap clean (not dirty) private
+ * pages within this region, env is expected to fault them back in
+ * (file server block cache does this). Zero size removes the region.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if region is not page-aligned or is not within user space. */
+static int
+sys_env_set_cache_region(envid_t envid, uintptr_t va, size_t size) {
+    if ((va | size) & CLASS_MASK(0)) return -E_INVAL;
+    if (va > MAX_USER_ADDRESS || size > MAX_USER_ADDRESS - va) return -E_INVAL;
+
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, true);
+    if (res < 0) return res;
+
+    env->env_cache_va = size ? va : 0;
+    env->env_cache_size = size;
+    return 0;
+}
+
+/* Set fault-around window of 'envid' to 'npages' pages.
+ * Lazy pages of the same mapping within aligned window around
+ * the faulting page are resolved along with it. Zero disables this.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if npages is not a power of 2 or is larger than FAULT_AROUND_MAX. */
+static int
+sys_env_set_fault_around(envid_t envid, size_t npages) {
+    if (npages > FAULT_AROUND_MAX || (npages & (npages - 1))) return -E_INVAL;
+
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, true);
+    if (res < 0) return res;
+
+    env->env_fault_around = npages;
+    return 0;
+}
+
+/* Set base scheduler priority of 'envid' to 'priority',
+ * from 0 (the highest) to SCHED_LEVELS - 1.
+ * The env is moved to the corresponding level right away.
+ * Like nice(), priority can only be lowered: it cannot become
+ * higher than the priority of the parent of envid (so the caller
+ * cannot raise a child above itself), or than SCHED_PRIO_DEFAULT
+ * if the parent no longer exists.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if priority is out of range or higher than allowed. */
+static int
+sys_env_set_priority(envid_t envid, int priority) {
+    if (priority < 0 || priority >= SCHED_LEVELS) return -E_INVAL;
+
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, true);
+    if (res < 0) return res;
+
+    struct Env *parent = NULL;
+    unsigned limit = SCHED_PRIO_DEFAULT;
+    if (env->env_parent_id && envid2env(env->env_parent_id, &parent, false) >= 0)
+        limit = parent->env_priority;
+    if ((unsigned)priority < MIN(limit, env->env_priority)) return -E_INVAL;
+
+    env_set_priority(env, priority);
+    return 0;
+}
+
+/* Move 'envid' to the fair scheduling class with given 'weight',
+ * it gets CPU time in proportion to its weight relative to other
+ * fair class envs (SCHED_WEIGHT_DEFAULT is nominal weight).
+ * Zero weight returns env to the priority-based scheduling.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if weight is larger than SCHED_WEIGHT_MAX. */
+static int
+sys_env_set_weight(envid_t envid, unsigned weight) {
+    if (weight > SCHED_WEIGHT_MAX) return -E_INVAL;
+
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, true);
+    if (res < 0) return res;
+
+    env_set_weight(env, weight);
+    return 0;
+}
+
+/* Tell the kernel how memory at [va, va + size) of 'envid' is going to be used:
+ *  ADVISE_WILLNEED allocates lazily mapped writable memory right away;
+ *  ADVISE_DONTNEED frees private memory, it reads as zeroes afterwards;
+ *  ADVISE_FREE lets the kernel do the same under memory pressure,
+ *      unless the page is written first.
+ * ADVISE_NORMAL, ADVISE_SEQUENTIAL and ADVISE_RANDOM set fault-around
+ * window of the whole env to default, maximal and zero respectively.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if va or size is not page-aligned, the region is not
+ *      in user space or advice is unknown.
+ *  -E_NO_MEM if there's no memory to remap the region. */
+static int
+sys_region_advise(envid_t envid, uintptr_t va, size_t size, int advice) {
+    if ((va | size) & CLASS_MASK(0)) return -E_INVAL;
+    if (va > MAX_USER_ADDRESS || size > MAX_USER_ADDRESS - va) return -E_INVAL;
+
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, true);
+    if (res < 0) return res;
+
+    switch (advice) {
+    case ADVISE_NORMAL:
+        env->env_fault_around = FAULT_AROUND_DEFAULT;
+        return 0;
+    case ADVISE_RANDOM:
+        env->env_fault_around = 0;
+        return 0;
+    case ADVISE_SEQUENTIAL:
+        env->env_fault_around = FAULT_AROUND_MAX;
+        return 0;
+    }
+
+    return size ? advise_region(&env->address_space, va, size, advice) : 0;
+}
+
+/* Open shared memory object 'name' ('len' characters long), creating it
+ * with 'size' bytes of zeroes if it does not exist and SHM_CREATE is set.
+ * Empty name creates anonymous object known only by its handle.
+ * Destroys the environment if 'name' is not readable.
+ *
+ * Returns object handle on success, < 0 on error (see shm_open()). */
+static int
+sys_shm_open(const char *name, size_t len, size_t size, int flags) {
+    if (len > SHM_NAME_MAX) return -E_INVAL;
+
+    char kname[SHM_NAME_MAX + 1];
+    user_mem_assert(curenv, name, len, PROT_USER_);
+    nosan_memcpy(kname, (void *)name, len);
+    kname[len] = '\0';
+
+    return shm_open(kname, size, flags);
+}
+
+/* Change size of shared memory object 'shm' to 'size' bytes.
+ * Only the creator of the object or its parent can do this.
+ *
+ * Returns 0 on success, < 0 on error (see shm_resize()). */
+static int
+sys_shm_resize(shmid_t shm, size_t size) {
+    return shm_resize(shm, size);
+}
+
+/* Map [offset, offset + size) of shared memory object 'shm'
+ * at 'va' in the address space of 'envid' with permission 'perm'.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  Others are described at shm_map(). */
+static int
+sys_shm_map(shmid_t shm, envid_t envid, uintptr_t va, size_t offset, size_t size, int perm) {
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, true);
+    if (res < 0) return res;
+
+    return shm_map(shm, &env->address_space, va, offset, size, perm);
+}
+
+/* Remove shared memory object 'shm', memory stays mapped
+ * in envs that use it. Only the creator of the object
+ * or its parent can do this.
+ *
+ * Returns 0 on success, < 0 on error (see shm_unlink()). */
+static int
+sys_shm_unlink(shmid_t shm) {
+    return shm_unlink(shm);
+}
+
+/* Copy memory manager statistics to 'stat'.
+ * Address space statistics describe environment 'envid'
+ * (any environment can be inspected, nothing is modified).
+ * Destroys the environment if 'stat' is not writable.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist. */
+static int
+sys_memstat(envid_t envid, struct MemStat *stat) {
+    struct Env *env = NULL;
+    int res = envid2env(envid, &env, false);
+    if (res < 0) return res;
+
+    user_mem_assert(curenv, stat, sizeof *stat, PROT_USER_ | PROT_W);
+
+    struct MemStat kstat;
+    memstat_read(&kstat, &env->address_space);
+    kstat.env_id = env->env_id;
+    kstat.env_faults = env->env_faults;
+    kstat.env_fault_around_pages = env->env_fault_around_pages;
+    nosan_memcpy((void *)stat, (void *)&kstat, sizeof kstat);
+    return 0;
+}
+
 /* Allocate a region of memory and map it at 'va' with permission
  * 'perm' in the address space of 'envid'.
  * The page's contents are set to 0.
@@ -175,6 +411,9 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func) {
  *
  * It allocates memory lazily so you need to use map_region
  * with PROT_LAZY and ALLOC_ONE/ALLOC_ZERO set.
+ * ALLOC_POPULATE allocates the whole region right away and
+ * ALLOC_HUGE does the same for its 2M-aligned parts, preferring
+ * physical blocks as large as the alignment allows.
  *
  * Don't forget to set PROT_USER_
  *
@@ -403,7 +642,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, uintptr_t srcva, size_t size, in
     to_env->env_ipc_recving = false;
     to_env->env_ipc_from = curenv->env_id;
     to_env->env_ipc_value = value;
-    to_env->env_status = ENV_RUNNABLE;
+    env_set_status(to_env, ENV_RUNNABLE);
     return 0;
 }
 
@@ -445,7 +684,8 @@ sys_ipc_recv(uintptr_t dstva, uintptr_t maxsize) {
         curenv->env_ipc_maxsz = maxsize;
     }
 
-    curenv->env_status = ENV_NOT_RUNNABLE;
+    sched_boost(curenv);
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
     curenv->env_tf.tf_regs.reg_rax = 0;
     sched_yield();
     return 0;
@@ -524,6 +764,39 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
         case SYS_map_physical_region:
             return (uintptr_t) sys_map_physical_region(a1, (envid_t) a2, a3, (size_t) a4, (int) a5);
 
+        case SYS_env_set_mm_flags:
+            return (uintptr_t) sys_env_set_mm_flags((envid_t) a1, (uint32_t) a2);
+
+        case SYS_memstat:
+            return (uintptr_t) sys_memstat((envid_t) a1, (struct MemStat *) a2);
+
+        case SYS_env_set_cache_region:
+            return (uintptr_t) sys_env_set_cache_region((envid_t) a1, a2, (size_t) a3);
+
+        case SYS_env_set_fault_around:
+            return (uintptr_t) sys_env_set_fault_around((envid_t) a1, (size_t) a2);
+
+        case SYS_region_advise:
+            return (uintptr_t) sys_region_advise((envid_t) a1, a2, (size_t) a3, (int) a4);
+
+        case SYS_shm_open:
+            return (uintptr_t) sys_shm_open((const char *) a1, (size_t) a2, (size_t) a3, (int) a4);
+
+        case SYS_shm_resize:
+            return (uintptr_t) sys_shm_resize((shmid_t) a1, (size_t) a2);
+
+        case SYS_shm_map:
+            return (uintptr_t) sys_shm_map((shmid_t) a1, (envid_t) a2, a3, (size_t) a4, (size_t) a5, (int) a6);
+
+        case SYS_shm_unlink:
+            return (uintptr_t) sys_shm_unlink((shmid_t) a1);
+
+        case SYS_env_set_priority:
+            return (uintptr_t) sys_env_set_priority((envid_t) a1, (int) a2);
+
+        case SYS_env_set_weight:
+            return (uintptr_t) sys_env_set_weight((envid_t) a1, (unsigned) a2);
+
         // case SYS_env_set_trapframe:
         //     return (uintptr_t) sys_env_set_trapframe((envid_t) a1, (struct Trapframe *) a2);
 
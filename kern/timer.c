@@ -51,6 +51,7 @@ struct Timer timer_hpet0 = {
         .get_cpu_freq = hpet_cpu_frequency,
         .enable_interrupts = hpet_enable_interrupts_tim0,
         .handle_interrupts = hpet_handle_interrupts_tim0,
+        .set_oneshot = hpet_set_oneshot_tim0,
 };
 
 struct Timer timer_hpet1 = {
@@ -59,6 +60,7 @@ struct Timer timer_hpet1 = {
         .get_cpu_freq = hpet_cpu_frequency,
         .enable_interrupts = hpet_enable_interrupts_tim1,
         .handle_interrupts = hpet_handle_interrupts_tim1,
+        .set_oneshot = hpet_set_oneshot_tim1,
 };
 
 struct Timer timer_acpipm = {
@@ -67,6 +69,43 @@ struct Timer timer_acpipm = {
         .get_cpu_freq = pmtimer_cpu_frequency,
 };
 
+/* Clockevent: scheduler timer interrupts are requested one at a time
+ * if timer_for_schedule supports it, otherwise it just keeps ticking */
+
+/* Timer still ticks periodically as set up by timers_schedule() */
+static bool clockevent_periodic = 1;
+/* One-shot interrupt is pending */
+static bool clockevent_armed;
+
+static bool
+clockevent_oneshot(void) {
+    return timer_for_schedule && timer_for_schedule->set_oneshot;
+}
+
+/* Request timer interrupt in ns nanoseconds unless one is pending already
+ * (the first request switches timer from periodic to one-shot mode) */
+void
+clockevent_program(uint64_t ns) {
+    if (!clockevent_oneshot() || (clockevent_armed && !clockevent_periodic)) return;
+    timer_for_schedule->set_oneshot(ns);
+    clockevent_periodic = 0;
+    clockevent_armed = 1;
+}
+
+/* Cancel pending timer interrupt or periodic ticks */
+void
+clockevent_stop(void) {
+    if (!clockevent_oneshot() || !(clockevent_armed || clockevent_periodic)) return;
+    timer_for_schedule->set_oneshot(0);
+    clockevent_periodic = clockevent_armed = 0;
+}
+
+void
+clockevent_handle(void) {
+    clockevent_armed = 0;
+    timer_for_schedule->handle_interrupts();
+}
+
 void
 acpi_enable(void) {
     FADT *fadt = get_fadt();
@@ -366,6 +405,39 @@ hpet_enable_interrupts_tim1(void) {
     pic_irq_unmask(IRQ_CLOCK);
 }
 
+/* Comparator is set at least this many HPET periods ahead,
+ * so that counter does not pass it while it is being written */
+#define HPET_MIN_DELTA 16
+
+static uint64_t
+hpet_delta(uint64_t ns) {
+    /* Keep multiplication from overflowing */
+    ns = MIN(ns, 10 * Giga);
+    return MAX(ns * hpetFreq / Giga, (uint64_t)HPET_MIN_DELTA);
+}
+
+/* Switch comparator to non-periodic mode and program it,
+ * it fires once when main counter reaches comparator value */
+void
+hpet_set_oneshot_tim0(uint64_t ns) {
+    if (!ns) {
+        hpetReg->TIM0_CONF &= ~HPET_TN_INT_ENB_CNF;
+        return;
+    }
+    hpetReg->TIM0_CONF = (IRQ_TIMER << 9) | HPET_TN_INT_ENB_CNF;
+    hpetReg->TIM0_COMP = hpetReg->MAIN_CNT + hpet_delta(ns);
+}
+
+void
+hpet_set_oneshot_tim1(uint64_t ns) {
+    if (!ns) {
+        hpetReg->TIM1_CONF &= ~HPET_TN_INT_ENB_CNF;
+        return;
+    }
+    hpetReg->TIM1_CONF = (IRQ_CLOCK << 9) | HPET_TN_INT_ENB_CNF;
+    hpetReg->TIM1_COMP = hpetReg->MAIN_CNT + hpet_delta(ns);
+}
+
 void
 hpet_handle_interrupts_tim0(void) {
     pic_send_eoi(IRQ_TIMER);
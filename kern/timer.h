@@ -15,6 +15,9 @@ struct Timer {
     uint64_t (*get_cpu_freq)(void);  /* Get CPU frequency */
     void (*enable_interrupts)(void); /* Init timer interrupts */
     void (*handle_interrupts)(void);
+    /* Program single interrupt in ns nanoseconds, 0 cancels it
+     * (NULL if timer can only tick periodically) */
+    void (*set_oneshot)(uint64_t ns);
 };
 
 #define MAX_TIMERS 5
@@ -28,6 +31,10 @@ extern struct Timer timer_hpet1;
 extern struct Timer timer_acpipm;
 extern struct Timer *timer_for_schedule;
 
+void clockevent_program(uint64_t ns);
+void clockevent_stop(void);
+void clockevent_handle(void);
+
 #pragma pack(push, 1)
 
 typedef struct {
@@ -200,6 +207,8 @@ void hpet_enable_interrupts_tim1(void);
 uint64_t hpet_cpu_frequency(void);
 void hpet_handle_interrupts_tim0(void);
 void hpet_handle_interrupts_tim1(void);
+void hpet_set_oneshot_tim0(uint64_t ns);
+void hpet_set_oneshot_tim1(uint64_t ns);
 
 uint32_t pmtimer_get_timeval(void);
 uint64_t pmtimer_cpu_frequency(void);
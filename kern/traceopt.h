@@ -50,4 +50,9 @@
 #define trace_init 1
 #endif
 
+/* Run memory manager microbenchmarks during boot */
+#ifndef bench_memory
+#define bench_memory 0
+#endif
+
 #endif
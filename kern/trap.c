@@ -291,10 +291,9 @@ trap_dispatch(struct Trapframe *tf) {
     case IRQ_OFFSET + IRQ_TIMER:
         // LAB 4: Your code here
         // LAB 5: Your code here
-        timer_for_schedule->handle_interrupts();
-        rtc_check_status();
+        clockevent_handle();
         pic_send_eoi(IRQ_CLOCK);
-        sched_yield();
+        sched_tick();
         return;
     default:
         print_trapframe(tf);
@@ -318,6 +317,9 @@ trap(struct Trapframe *tf) {
     extern char *panicstr;
     if (panicstr) asm volatile("hlt");
 
+    /* Charge the interrupted env for its user mode time */
+    bool from_user = sched_enter_kernel();
+
     /* Check that interrupts are disabled.  If this assertion
      * fails, DO NOT be tempted to fix it by inserting a "cli" in
      * the interrupt path */
@@ -364,12 +366,19 @@ trap(struct Trapframe *tf) {
                     res ? can_redir ? "redirected to user" : "fault" : "resolved by kernel");
         }
         if (!res) {
+            fault_around(current_space, va);
             in_page_fault = 0;
+            if (from_user) sched_leave_kernel();
             env_pop_tf(tf);
         }
     }
 
-    assert(curenv);
+    /* Interrupt woke CPU up in sched_halt(),
+     * there is no env state to be saved */
+    if (!curenv) {
+        trap_dispatch(tf);
+        sched_yield();
+    }
 
     /* Copy trap frame (which is currently on the stack)
      * into 'curenv->env_tf', so that running the environment
@@ -450,6 +459,7 @@ page_fault_handler(struct Trapframe *tf) {
         goto destroy;
     }
     cprintf("[%08x] env_pgfault_upcall at %p\n", curenv->env_id, curenv->env_pgfault_upcall);
+    curenv->env_user_faults++;
 
     /* Force allocate exception stack page to prevent memcpy from
      * causing pagefault during another pagefault */
@@ -137,6 +137,61 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall) {
     return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uintptr_t)upcall, 0, 0, 0, 0);
 }
 
+int
+sys_env_set_mm_flags(envid_t envid, uint32_t flags) {
+    return syscall(SYS_env_set_mm_flags, 1, envid, flags, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_cache_region(envid_t envid, void *va, size_t size) {
+    return syscall(SYS_env_set_cache_region, 1, envid, (uintptr_t)va, size, 0, 0, 0);
+}
+
+int
+sys_env_set_fault_around(envid_t envid, size_t npages) {
+    return syscall(SYS_env_set_fault_around, 1, envid, npages, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int priority) {
+    return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_weight(envid_t envid, unsigned weight) {
+    return syscall(SYS_env_set_weight, 1, envid, weight, 0, 0, 0, 0);
+}
+
+int
+sys_region_advise(envid_t envid, void *va, size_t size, int advice) {
+    return syscall(SYS_region_advise, 1, envid, (uintptr_t)va, size, advice, 0, 0);
+}
+
+shmid_t
+sys_shm_open(const char *name, size_t size, int flags) {
+    return syscall(SYS_shm_open, 0, (uintptr_t)name, name ? strlen(name) : 0, size, flags, 0, 0);
+}
+
+int
+sys_shm_resize(shmid_t shm, size_t size) {
+    return syscall(SYS_shm_resize, 1, shm, size, 0, 0, 0, 0);
+}
+
+int
+sys_shm_map(shmid_t shm, envid_t envid, void *va, size_t offset, size_t size, int perm) {
+    return syscall(SYS_shm_map, 1, shm, envid, (uintptr_t)va, offset, size, perm);
+}
+
+int
+sys_shm_unlink(shmid_t shm) {
+    return syscall(SYS_shm_unlink, 1, shm, 0, 0, 0, 0, 0);
+}
+
+int
+sys_memstat(envid_t envid, struct MemStat *stat) {
+    return syscall(SYS_memstat, 1, envid, (uintptr_t)stat, 0, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uintptr_t value, void *srcva, size_t size, int perm) {
     return syscall(SYS_ipc_try_send, 0, envid, value, (uintptr_t)srcva, size, perm, 0);
@@ -0,0 +1,55 @@
+/* Check region advice.
+ * Pages dropped with ADVISE_DONTNEED should read back as zeroes.
+ * Pages marked with ADVISE_FREE may only lose their contents
+ * as a whole and only until they are written. */
+
+#include <inc/lib.h>
+
+#define NPAGES 16
+
+#define BUF ((uint8_t *)0x40000000)
+
+static void
+fill(size_t from, size_t to) {
+    for (size_t i = from; i < to; i++)
+        memset(BUF + i * PAGE_SIZE, i + 1, PAGE_SIZE);
+}
+
+/* Returns true if page has its original contents,
+ * false if it is zero-filled */
+static bool
+check_page(size_t i, bool may_be_zero) {
+    uint8_t first = BUF[i * PAGE_SIZE];
+    if (first != (uint8_t)(i + 1) && (!may_be_zero || first))
+        panic("page %lu: unexpected value %02x", (unsigned long)i, first);
+    for (size_t j = 0; j < PAGE_SIZE; j++)
+        if (BUF[i * PAGE_SIZE + j] != first) panic("page %lu: partially lost", (unsigned long)i);
+    return first;
+}
+
+void
+umain(int argc, char **argv) {
+    int res = sys_alloc_region(CURENVID, BUF, NPAGES * PAGE_SIZE, PROT_RW);
+    if (res < 0) panic("sys_alloc_region: %i", res);
+    fill(0, NPAGES);
+
+    /* Dropped memory is zero-filled again */
+    res = sys_region_advise(CURENVID, BUF, NPAGES / 2 * PAGE_SIZE, ADVISE_DONTNEED);
+    if (res < 0) panic("sys_region_advise(ADVISE_DONTNEED): %i", res);
+    for (size_t i = 0; i < NPAGES / 2 * PAGE_SIZE; i++)
+        if (BUF[i]) panic("byte %lu is not zero after ADVISE_DONTNEED", (unsigned long)i);
+    fill(0, NPAGES / 2);
+    for (size_t i = 0; i < NPAGES / 2; i++)
+        check_page(i, 0);
+    cprintf("advise: ADVISE_DONTNEED OK\n");
+
+    /* Pages written after being marked keep new contents,
+     * others keep the old ones unless memory ran out */
+    res = sys_region_advise(CURENVID, BUF, NPAGES * PAGE_SIZE, ADVISE_FREE);
+    if (res < 0) panic("sys_region_advise(ADVISE_FREE): %i", res);
+    fill(0, NPAGES / 2);
+    size_t dropped = 0;
+    for (size_t i = 0; i < NPAGES; i++)
+        dropped += !check_page(i, i >= NPAGES / 2);
+    cprintf("advise: ADVISE_FREE OK, %lu unwritten pages dropped\n", (unsigned long)dropped);
+}
@@ -0,0 +1,63 @@
+/* Measure the cost of copy-on-write faults.
+ * A buffer of small pages is shared with two children by fork().
+ * Then every page is copied once on behalf of a child that is
+ * not running at the moment (kernel resolves the fault while
+ * mapping the page into the parent) and once by the parent
+ * writing to the page itself. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES 256
+
+#define BUF  ((uint8_t *)0x40000000)
+#define COPY ((uint8_t *)0x80000000)
+
+static envid_t
+spawn_child(void) {
+    envid_t who = fork();
+    if (who < 0) panic("fork: %i", who);
+    if (!who) {
+        /* Keep pages shared until parent is done */
+        ipc_recv(NULL, NULL, NULL, NULL);
+        exit();
+    }
+    return who;
+}
+
+void
+umain(int argc, char **argv) {
+    /* Allocate every page separately to get 4K mappings */
+    for (size_t i = 0; i < NPAGES; i++) {
+        int res = sys_alloc_region(CURENVID, BUF + i * PAGE_SIZE, PAGE_SIZE, PROT_RW);
+        if (res < 0) panic("sys_alloc_region: %i", res);
+        BUF[i * PAGE_SIZE] = (uint8_t)i;
+    }
+
+    envid_t child1 = spawn_child();
+    envid_t child2 = spawn_child();
+
+    /* Copies are made in the child address space */
+    uint64_t start = read_tsc();
+    int res = sys_map_region(child1, BUF, CURENVID, COPY, NPAGES * PAGE_SIZE, PROT_RW);
+    uint64_t remote = read_tsc() - start;
+    if (res < 0) panic("sys_map_region: %i", res);
+
+    /* Copies are made in the current address space */
+    start = read_tsc();
+    for (size_t i = 0; i < NPAGES; i++)
+        BUF[i * PAGE_SIZE] = (uint8_t)~i;
+    uint64_t local = read_tsc() - start;
+
+    for (size_t i = 0; i < NPAGES; i++) {
+        assert(COPY[i * PAGE_SIZE] == (uint8_t)i);
+        assert(BUF[i * PAGE_SIZE] == (uint8_t)~i);
+    }
+
+    cprintf("cowbench: %d pages\n", NPAGES);
+    cprintf("cowbench: %lu cycles per fault resolved for another env\n", (unsigned long)(remote / NPAGES));
+    cprintf("cowbench: %lu cycles per fault in current env\n", (unsigned long)(local / NPAGES));
+
+    ipc_send(child1, 0, NULL, 0, 0);
+    ipc_send(child2, 0, NULL, 0, 0);
+}
@@ -0,0 +1,58 @@
+/* Check CPU shares of fair class envs.
+ * Children with different weights spin incrementing counters in
+ * shared memory. Parent stays in the priority class, which goes
+ * ahead of the fair class, and yields, so it only wakes up on
+ * timer ticks to count them. In the end
+ * counters should be proportional to weights. */
+
+#include <inc/lib.h>
+
+#define NCHILDREN 3
+#define NTICKS    42
+
+#define PARENT_VIEW ((volatile uint64_t *)0x40000000)
+#define CHILD_VIEW  ((volatile uint64_t *)0x80000000)
+
+static const unsigned weights[NCHILDREN] = {SCHED_WEIGHT_DEFAULT, 2 * SCHED_WEIGHT_DEFAULT, 4 * SCHED_WEIGHT_DEFAULT};
+
+void
+umain(int argc, char **argv) {
+    shmid_t shm = sys_shm_open("", PAGE_SIZE, SHM_CREATE);
+    if (shm < 0) panic("sys_shm_open: %i", shm);
+    int res = sys_shm_map(shm, CURENVID, (void *)PARENT_VIEW, 0, PAGE_SIZE, PROT_RW);
+    if (res < 0) panic("sys_shm_map: %i", res);
+
+    envid_t children[NCHILDREN];
+    for (size_t i = 0; i < NCHILDREN; i++) {
+        envid_t who = fork();
+        if (who < 0) panic("fork: %i", who);
+        if (!who) {
+            res = sys_shm_map(shm, CURENVID, (void *)CHILD_VIEW, 0, PAGE_SIZE, PROT_RW);
+            if (res < 0) panic("sys_shm_map: %i", res);
+            for (;;) CHILD_VIEW[i]++;
+        }
+        if ((res = sys_env_set_weight(who, weights[i])) < 0)
+            panic("sys_env_set_weight: %i", res);
+        children[i] = who;
+    }
+
+    for (size_t i = 0; i < NTICKS; i++)
+        sys_yield();
+
+    uint64_t counts[NCHILDREN];
+    for (size_t i = 0; i < NCHILDREN; i++) {
+        counts[i] = PARENT_VIEW[i];
+        sys_env_destroy(children[i]);
+    }
+
+    for (size_t i = 0; i < NCHILDREN; i++) {
+        /* Share relative to the first child in percents of the expected one */
+        uint64_t share = counts[i] * weights[0] * 100 / (counts[0] * weights[i] + 1);
+        cprintf("fairshare: weight %5u: %lu iterations, %lu%% of expected share\n",
+                weights[i], (unsigned long)counts[i], (unsigned long)share);
+        if (share < 70 || share > 130) panic("unfair share for weight %u", weights[i]);
+    }
+
+    sys_shm_unlink(shm);
+    cprintf("fairshare: OK\n");
+}
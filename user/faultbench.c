@@ -0,0 +1,44 @@
+/* Tune fault-around window.
+ * A buffer is allocated page by page, so it consists of lazy 4K
+ * mappings, and is then touched sequentially. This is repeated
+ * for several windows, each time with a fresh buffer. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES 256 /* 1M buffer */
+
+#define BUF ((uint8_t *)0x40000000)
+
+static const size_t windows[] = {0, 4, 16, 64, 256};
+
+void
+umain(int argc, char **argv) {
+    cprintf("faultbench: %d pages touched sequentially\n", NPAGES);
+
+    for (size_t w = 0; w < sizeof(windows) / sizeof(*windows); w++) {
+        uint8_t *buf = BUF + w * NPAGES * PAGE_SIZE;
+        for (size_t i = 0; i < NPAGES; i++) {
+            int res = sys_alloc_region(CURENVID, buf + i * PAGE_SIZE, PAGE_SIZE, PROT_RW);
+            if (res < 0) panic("sys_alloc_region: %i", res);
+        }
+
+        int res = sys_env_set_fault_around(CURENVID, windows[w]);
+        if (res < 0) panic("sys_env_set_fault_around: %i", res);
+
+        struct MemStat prev, stat;
+        if ((res = sys_memstat(CURENVID, &prev)) < 0) panic("sys_memstat: %i", res);
+
+        uint64_t start = read_tsc();
+        for (size_t i = 0; i < NPAGES; i++)
+            buf[i * PAGE_SIZE] = (uint8_t)i;
+        uint64_t cycles = read_tsc() - start;
+
+        if ((res = sys_memstat(CURENVID, &stat)) < 0) panic("sys_memstat: %i", res);
+
+        cprintf("faultbench: window %3lu: %lu cycles per page, %lu faults, %lu pages faulted around\n",
+                (unsigned long)windows[w], (unsigned long)(cycles / NPAGES),
+                (unsigned long)(stat.env_faults - prev.env_faults),
+                (unsigned long)(stat.env_fault_around_pages - prev.env_fault_around_pages));
+    }
+}
@@ -0,0 +1,63 @@
+/* Measure the cost of fork() for an env with large heap.
+ * Heap is mapped with small pages, then the env forks several times
+ * and every child writes to a few pages spread over the heap and exits.
+ * After that parent writes to the whole heap itself. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES 4096 /* 16M heap */
+#define NFORKS 8
+#define NTOUCH 16
+
+#define HEAP ((uint8_t *)0x40000000)
+
+void
+umain(int argc, char **argv) {
+    /* Allocate every page separately to get 4K mappings */
+    for (size_t i = 0; i < NPAGES; i++) {
+        int res = sys_alloc_region(CURENVID, HEAP + i * PAGE_SIZE, PAGE_SIZE, PROT_RW);
+        if (res < 0) panic("sys_alloc_region: %i", res);
+        HEAP[i * PAGE_SIZE] = (uint8_t)i;
+    }
+
+    struct MemStat prev, stat;
+    int res = sys_memstat(CURENVID, &prev);
+    if (res < 0) panic("sys_memstat: %i", res);
+
+    uint64_t forks = 0;
+    for (size_t n = 0; n < NFORKS; n++) {
+        uint64_t start = read_tsc();
+        envid_t who = fork();
+        if (who < 0) panic("fork: %i", who);
+        if (!who) {
+            for (size_t i = 0; i < NTOUCH; i++) {
+                size_t page = i * (NPAGES / NTOUCH);
+                assert(HEAP[page * PAGE_SIZE] == (uint8_t)page);
+                HEAP[page * PAGE_SIZE] = (uint8_t)~page;
+            }
+            exit();
+        }
+        forks += read_tsc() - start;
+        wait(who);
+    }
+
+    /* Children should not have changed anything here */
+    uint64_t start = read_tsc();
+    for (size_t i = 0; i < NPAGES; i++) {
+        assert(HEAP[i * PAGE_SIZE] == (uint8_t)i);
+        HEAP[i * PAGE_SIZE] = (uint8_t)~i;
+    }
+    uint64_t writes = read_tsc() - start;
+
+    if ((res = sys_memstat(CURENVID, &stat)) < 0) panic("sys_memstat: %i", res);
+
+    cprintf("forkbench: %d pages, %d forks, %d pages written by each child\n", NPAGES, NFORKS, NTOUCH);
+    cprintf("forkbench: %lu cycles per fork\n", (unsigned long)(forks / NFORKS));
+    cprintf("forkbench: %lu cycles per page written by parent after forks\n", (unsigned long)(writes / NPAGES));
+    cprintf("forkbench: page tables shared %lu, copied %lu, taken over %lu\n",
+            (unsigned long)(stat.pt_shared - prev.pt_shared),
+            (unsigned long)(stat.pt_copied - prev.pt_copied),
+            (unsigned long)(stat.pt_adopted - prev.pt_adopted));
+    if (stat.pt_shared == prev.pt_shared) panic("fork did not share page tables");
+}
@@ -0,0 +1,48 @@
+/* Check huge page allocation with ALLOC_HUGE.
+ * Every 2M-aligned part of the region should be backed by single
+ * 2M physical block mapped with one PDE right away, so touching
+ * it causes no page faults. */
+
+#include <inc/lib.h>
+#include <inc/mmu.h>
+
+#define NHUGE 2
+
+#define BUF ((uint8_t *)0x40000000)
+
+void
+umain(int argc, char **argv) {
+    struct MemStat start, stat;
+    int res = sys_memstat(CURENVID, &start);
+    if (res < 0) panic("sys_memstat: %i", res);
+
+    res = sys_alloc_region(CURENVID, BUF, NHUGE * HUGE_PAGE_SIZE, PROT_RW | ALLOC_HUGE);
+    if (res < 0) panic("sys_alloc_region: %i", res);
+
+    if ((res = sys_memstat(CURENVID, &stat)) < 0) panic("sys_memstat: %i", res);
+    if (stat.env_resident - start.env_resident < NHUGE * HUGE_PAGE_SIZE)
+        panic("only %luK allocated right away", (unsigned long)((stat.env_resident - start.env_resident) / 1024));
+
+    for (size_t i = 0; i < NHUGE; i++) {
+        uint8_t *huge = BUF + i * HUGE_PAGE_SIZE;
+        if (!(get_uvpt_entry(huge) & PTE_PS)) panic("part %lu is not mapped with huge page", (unsigned long)i);
+
+        /* Single physical block */
+        uintptr_t phys = get_phys_addr(huge);
+        if (phys & (HUGE_PAGE_SIZE - 1)) panic("part %lu is not 2M-aligned physically", (unsigned long)i);
+        for (size_t off = 0; off < HUGE_PAGE_SIZE; off += PAGE_SIZE)
+            if (get_phys_addr(huge + off) != phys + off) panic("part %lu is not contiguous", (unsigned long)i);
+    }
+
+    /* Memory is zero-filled and writable without faults */
+    struct MemStat prev = stat;
+    for (size_t i = 0; i < NHUGE * HUGE_PAGE_SIZE; i += PAGE_SIZE) {
+        if (BUF[i]) panic("byte %lu is not zero", (unsigned long)i);
+        BUF[i] = 1;
+    }
+    if ((res = sys_memstat(CURENVID, &stat)) < 0) panic("sys_memstat: %i", res);
+    if (stat.env_faults != prev.env_faults)
+        panic("%lu page faults on populated memory", (unsigned long)(stat.env_faults - prev.env_faults));
+
+    cprintf("hugealloc: OK\n");
+}
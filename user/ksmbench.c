@@ -0,0 +1,77 @@
+/* Check merging of identical pages.
+ * Two children opt into ENV_MM_KSM, fill the same pages with
+ * the same data and block. Parent yields until the kernel, having
+ * nothing else to run, merges them and then lets children check that
+ * their data survived and that writing to merged pages copies them back. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCHILDREN 2
+#define NPAGES    64
+#define TIMEOUT   20000000000ULL /* TSC cycles to wait for merging */
+
+#define BUF ((uint8_t *)0x40000000)
+
+static void
+child(void) {
+    int res = sys_env_set_mm_flags(CURENVID, ENV_MM_KSM);
+    if (res < 0) panic("sys_env_set_mm_flags: %i", res);
+    res = sys_alloc_region(CURENVID, BUF, NPAGES * PAGE_SIZE, PROT_RW);
+    if (res < 0) panic("sys_alloc_region: %i", res);
+
+    /* Pages differ from each other but not between children */
+    for (size_t i = 0; i < NPAGES; i++)
+        memset(BUF + i * PAGE_SIZE, i + 1, PAGE_SIZE);
+
+    envid_t parent = thisenv->env_parent_id;
+    ipc_send(parent, 0, NULL, 0, 0);
+    ipc_recv(NULL, NULL, NULL, NULL);
+
+    for (size_t i = 0; i < NPAGES; i++) {
+        for (size_t j = 0; j < PAGE_SIZE; j++)
+            if (BUF[i * PAGE_SIZE + j] != (uint8_t)(i + 1)) panic("page %lu corrupted", (unsigned long)i);
+        BUF[i * PAGE_SIZE] = 0;
+    }
+    ipc_send(parent, 0, NULL, 0, 0);
+}
+
+void
+umain(int argc, char **argv) {
+    struct MemStat start, stat;
+    int res = sys_memstat(CURENVID, &start);
+    if (res < 0) panic("sys_memstat: %i", res);
+
+    envid_t children[NCHILDREN];
+    for (size_t i = 0; i < NCHILDREN; i++) {
+        envid_t who = fork();
+        if (who < 0) panic("fork: %i", who);
+        if (!who) {
+            child();
+            return;
+        }
+        children[i] = who;
+    }
+
+    /* Wait until children filled their pages */
+    for (size_t i = 0; i < NCHILDREN; i++)
+        ipc_recv(NULL, NULL, NULL, NULL);
+
+    uint64_t begin = read_tsc();
+    do {
+        sys_yield();
+        if ((res = sys_memstat(CURENVID, &stat)) < 0) panic("sys_memstat: %i", res);
+    } while (stat.ksm_merged - start.ksm_merged < NPAGES && read_tsc() - begin < TIMEOUT);
+
+    uint64_t merged = stat.ksm_merged - start.ksm_merged;
+    cprintf("ksmbench: merged %lu pages in %lu cycles, %luK saved\n",
+            (unsigned long)merged, (unsigned long)(read_tsc() - begin),
+            (unsigned long)(stat.ksm_saved_bytes / 1024));
+    if (merged < NPAGES) panic("only %lu of %d pages merged", (unsigned long)merged, NPAGES);
+
+    for (size_t i = 0; i < NCHILDREN; i++) {
+        ipc_send(children[i], 0, NULL, 0, 0);
+        ipc_recv(NULL, NULL, NULL, NULL);
+    }
+    cprintf("ksmbench: OK\n");
+}
@@ -0,0 +1,92 @@
+/* Measure IPC round trip latency while CPU hogs are running.
+ * Server child answers every request, hogs just spin like user/spin.c.
+ * Latency percentiles are reported without hogs, with hogs
+ * at default priority and with hogs at the lowest priority. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NHOGS   4
+#define NROUNDS 100
+
+static envid_t hogs[NHOGS];
+static uint64_t samples[NROUNDS];
+
+static void
+serve(void) {
+    for (;;) {
+        envid_t who;
+        int32_t value = ipc_recv(&who, NULL, NULL, NULL);
+        ipc_send(who, value + 1, NULL, 0, 0);
+    }
+}
+
+static void
+spawn_hogs(int priority) {
+    for (size_t i = 0; i < NHOGS; i++) {
+        envid_t who = fork();
+        if (who < 0) panic("fork: %i", who);
+        if (!who) {
+            for (;;) /* do nothing */
+                ;
+        }
+        if (priority >= 0) {
+            int res = sys_env_set_priority(who, priority);
+            if (res < 0) panic("sys_env_set_priority: %i", res);
+        }
+        hogs[i] = who;
+    }
+}
+
+static void
+kill_hogs(void) {
+    for (size_t i = 0; i < NHOGS; i++) {
+        int res = sys_env_destroy(hogs[i]);
+        if (res < 0) panic("sys_env_destroy: %i", res);
+    }
+}
+
+static void
+measure(const char *name, envid_t server) {
+    for (size_t i = 0; i < NROUNDS; i++) {
+        uint64_t start = read_tsc();
+        ipc_send(server, i, NULL, 0, 0);
+        int32_t value = ipc_recv(NULL, NULL, NULL, NULL);
+        samples[i] = read_tsc() - start;
+        if (value != (int32_t)i + 1) panic("unexpected reply %d", value);
+    }
+
+    /* Insertion sort is fine for this many samples */
+    for (size_t i = 1; i < NROUNDS; i++) {
+        uint64_t cur = samples[i];
+        size_t j = i;
+        for (; j > 0 && samples[j - 1] > cur; j--)
+            samples[j] = samples[j - 1];
+        samples[j] = cur;
+    }
+
+    cprintf("latencybench: %-22s p50 %lu, p90 %lu, p99 %lu, max %lu cycles\n", name,
+            (unsigned long)samples[NROUNDS / 2], (unsigned long)samples[NROUNDS * 9 / 10],
+            (unsigned long)samples[NROUNDS * 99 / 100], (unsigned long)samples[NROUNDS - 1]);
+}
+
+void
+umain(int argc, char **argv) {
+    cprintf("latencybench: %d round trips, %d hogs\n", NROUNDS, NHOGS);
+
+    envid_t server = fork();
+    if (server < 0) panic("fork: %i", server);
+    if (!server) serve();
+
+    measure("no hogs:", server);
+
+    spawn_hogs(-1);
+    measure("hogs at default:", server);
+    kill_hogs();
+
+    spawn_hogs(SCHED_LEVELS - 1);
+    measure("hogs at lowest:", server);
+    kill_hogs();
+
+    sys_env_destroy(server);
+}
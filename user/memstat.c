@@ -0,0 +1,60 @@
+/* Report memory manager statistics over time.
+ * Every sample touches a few more zero-filled pages and
+ * prints how free memory and fault counters changed. */
+
+#include <inc/lib.h>
+
+#define NSAMPLES 4
+#define NPAGES   64
+
+#define BUF ((uint8_t *)0x40000000)
+
+static uint64_t
+sum(const uint64_t *counters) {
+    uint64_t res = 0;
+    for (size_t i = 0; i < MEMSTAT_FAULT_CLASSES; i++)
+        res += counters[i];
+    return res;
+}
+
+static void
+print_stat(const struct MemStat *stat, const struct MemStat *prev) {
+    cprintf("memstat: free %luK cached %luK slab %luK, descriptors %lu/%lu\n",
+            (unsigned long)(stat->free_bytes / 1024), (unsigned long)(stat->cached_bytes / 1024),
+            (unsigned long)(stat->slab_bytes / 1024),
+            (unsigned long)(stat->desc_total - stat->desc_free), (unsigned long)stat->desc_total);
+    cprintf("memstat: faults cow +%lu zero +%lu reuse +%lu huge +%lu\n",
+            (unsigned long)(sum(stat->cow_faults) - sum(prev->cow_faults)),
+            (unsigned long)(sum(stat->zero_faults) - sum(prev->zero_faults)),
+            (unsigned long)(sum(stat->reuse_faults) - sum(prev->reuse_faults)),
+            (unsigned long)(stat->cow_faults[MEMSTAT_HUGE_CLASS] + stat->zero_faults[MEMSTAT_HUGE_CLASS] -
+                            prev->cow_faults[MEMSTAT_HUGE_CLASS] - prev->zero_faults[MEMSTAT_HUGE_CLASS]));
+    cprintf("memstat: env %08x resident %luK shared %luK, faults +%lu around +%lu\n", stat->env_id,
+            (unsigned long)(stat->env_resident / 1024), (unsigned long)(stat->env_shared / 1024),
+            (unsigned long)(stat->env_faults - prev->env_faults),
+            (unsigned long)(stat->env_fault_around_pages - prev->env_fault_around_pages));
+    cprintf("memstat: merged +%lu zero +%lu, %luK saved by same-page merging\n",
+            (unsigned long)(stat->ksm_merged - prev->ksm_merged),
+            (unsigned long)(stat->ksm_zero - prev->ksm_zero),
+            (unsigned long)(stat->ksm_saved_bytes / 1024));
+}
+
+void
+umain(int argc, char **argv) {
+    struct MemStat prev, stat;
+
+    int res = sys_alloc_region(CURENVID, BUF, NSAMPLES * NPAGES * PAGE_SIZE, PROT_RW);
+    if (res < 0) panic("sys_alloc_region: %i", res);
+
+    if ((res = sys_memstat(CURENVID, &prev)) < 0) panic("sys_memstat: %i", res);
+
+    for (size_t i = 0; i < NSAMPLES; i++) {
+        for (size_t j = 0; j < NPAGES; j++)
+            BUF[(i * NPAGES + j) * PAGE_SIZE] = 1;
+        sys_yield();
+
+        if ((res = sys_memstat(CURENVID, &stat)) < 0) panic("sys_memstat: %i", res);
+        print_stat(&stat, &prev);
+        prev = stat;
+    }
+}
@@ -0,0 +1,71 @@
+/* Measure scheduling overhead depending on the number of envs.
+ * Parent forks children which either block in ipc_recv() or spin
+ * in sys_yield() and then times its own sys_yield() calls.
+ * Blocked children are never chosen, so the cost of yield should
+ * not grow with their number. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NYIELDS 1000
+
+static const size_t counts[] = {0, 8, 64, 256};
+
+static envid_t children[256];
+
+static void
+spawn(size_t n, bool runnable) {
+    for (size_t i = 0; i < n; i++) {
+        envid_t who = fork();
+        if (who < 0) panic("fork: %i", who);
+        if (!who) {
+            for (;;) {
+                if (runnable)
+                    sys_yield();
+                else
+                    ipc_recv(NULL, NULL, NULL, NULL);
+            }
+        }
+        children[i] = who;
+    }
+
+    /* Let every child run once to reach its loop */
+    sys_yield();
+}
+
+static void
+reap(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int res = sys_env_destroy(children[i]);
+        if (res < 0) panic("sys_env_destroy: %i", res);
+    }
+}
+
+static uint64_t
+time_yields(void) {
+    uint64_t start = read_tsc();
+    for (size_t i = 0; i < NYIELDS; i++)
+        sys_yield();
+    return read_tsc() - start;
+}
+
+void
+umain(int argc, char **argv) {
+    cprintf("schedbench: %d yields per measurement\n", NYIELDS);
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(*counts); c++) {
+        size_t n = counts[c];
+
+        spawn(n, 0);
+        uint64_t blocked = time_yields();
+        reap(n);
+
+        spawn(n, 1);
+        uint64_t runnable = time_yields();
+        reap(n);
+
+        cprintf("schedbench: %3lu envs: %lu cycles per yield with blocked envs, %lu cycles per switch with runnable envs\n",
+                (unsigned long)n, (unsigned long)(blocked / NYIELDS),
+                (unsigned long)(runnable / (NYIELDS * (n + 1))));
+    }
+}
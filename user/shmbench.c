@@ -0,0 +1,73 @@
+/* Exchange large buffers through named shared memory object.
+ * Parent creates the object and forks a consumer, which opens it
+ * by name and maps it at a different address. Every round parent
+ * fills the buffer and consumer sends back its checksum over IPC. */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NAME    "shmbench"
+#define SIZE    (4 * 1024 * 1024)
+#define NROUNDS 8
+
+#define PRODUCER_BUF ((uint64_t *)0x40000000)
+#define CONSUMER_BUF ((uint64_t *)0x80000000)
+
+static uint32_t
+checksum(const uint64_t *buf) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < SIZE / sizeof(*buf); i++)
+        sum += buf[i];
+    return (uint32_t)(sum ^ (sum >> 32));
+}
+
+static void
+consumer(void) {
+    shmid_t shm = sys_shm_open(NAME, 0, 0);
+    if (shm < 0) panic("sys_shm_open: %i", shm);
+
+    int res = sys_shm_map(shm, CURENVID, CONSUMER_BUF, 0, SIZE, PROT_R);
+    if (res < 0) panic("sys_shm_map: %i", res);
+
+    for (size_t i = 0; i < NROUNDS; i++) {
+        envid_t from = 0;
+        ipc_recv(&from, NULL, NULL, NULL);
+        ipc_send(from, checksum(CONSUMER_BUF), NULL, 0, 0);
+    }
+}
+
+void
+umain(int argc, char **argv) {
+    shmid_t shm = sys_shm_open(NAME, SIZE, SHM_CREATE | SHM_EXCL);
+    if (shm < 0) panic("sys_shm_open: %i", shm);
+
+    envid_t who = fork();
+    if (who < 0) panic("fork: %i", who);
+    if (!who) {
+        consumer();
+        return;
+    }
+
+    int res = sys_shm_map(shm, CURENVID, PRODUCER_BUF, 0, SIZE, PROT_RW);
+    if (res < 0) panic("sys_shm_map: %i", res);
+
+    uint64_t cycles = 0;
+    for (size_t i = 0; i < NROUNDS; i++) {
+        for (size_t j = 0; j < SIZE / sizeof(uint64_t); j++)
+            PRODUCER_BUF[j] = i * j;
+        uint32_t expected = checksum(PRODUCER_BUF);
+
+        uint64_t start = read_tsc();
+        ipc_send(who, i, NULL, 0, 0);
+        uint32_t sum = ipc_recv(NULL, NULL, NULL, NULL);
+        cycles += read_tsc() - start;
+
+        if (sum != expected) panic("round %lu: checksum %08x, expected %08x", (unsigned long)i, sum, expected);
+    }
+
+    wait(who);
+    if ((res = sys_shm_unlink(shm)) < 0) panic("sys_shm_unlink: %i", res);
+
+    cprintf("shmbench: %d rounds of %dK, %lu cycles per round trip\n",
+            NROUNDS, SIZE / 1024, (unsigned long)(cycles / NROUNDS));
+}
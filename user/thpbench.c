@@ -0,0 +1,75 @@
+/* Check collapsing of small pages into huge pages.
+ * Env opts into ENV_MM_THP, populates 2M range 4K at a time and
+ * yields until the kernel, having nothing else to run, maps the range
+ * with single huge page. Data should survive collapse, writes after it
+ * and splitting the huge page back by unmapping a part of it. */
+
+#include <inc/lib.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+
+#define NPAGES  (HUGE_PAGE_SIZE / PAGE_SIZE)
+#define TIMEOUT 20000000000ULL /* TSC cycles to wait for collapse */
+
+#define BUF ((uint8_t *)0x40000000)
+
+static void
+check(size_t from, size_t to, uint8_t xor) {
+    for (size_t i = from; i < to; i++) {
+        uint64_t *page = (uint64_t *)(BUF + i * PAGE_SIZE);
+        for (size_t j = 0; j < PAGE_SIZE / sizeof(*page); j++)
+            if (page[j] != (uint8_t)(i ^ xor)) panic("page %lu corrupted", (unsigned long)i);
+    }
+}
+
+static void
+fill(uint8_t xor) {
+    for (size_t i = 0; i < NPAGES; i++) {
+        uint64_t *page = (uint64_t *)(BUF + i * PAGE_SIZE);
+        for (size_t j = 0; j < PAGE_SIZE / sizeof(*page); j++)
+            page[j] = (uint8_t)(i ^ xor);
+    }
+}
+
+void
+umain(int argc, char **argv) {
+    int res = sys_env_set_mm_flags(CURENVID, ENV_MM_THP);
+    if (res < 0) panic("sys_env_set_mm_flags: %i", res);
+
+    /* Allocate every page separately to get 4K mappings */
+    for (size_t i = 0; i < NPAGES; i++) {
+        res = sys_alloc_region(CURENVID, BUF + i * PAGE_SIZE, PAGE_SIZE, PROT_RW);
+        if (res < 0) panic("sys_alloc_region: %i", res);
+    }
+    fill(0);
+    if (get_uvpt_entry(BUF) & PTE_PS) panic("range is mapped with huge page too early");
+
+    struct MemStat start, stat;
+    if ((res = sys_memstat(CURENVID, &start)) < 0) panic("sys_memstat: %i", res);
+
+    uint64_t begin = read_tsc();
+    do {
+        sys_yield();
+        if ((res = sys_memstat(CURENVID, &stat)) < 0) panic("sys_memstat: %i", res);
+    } while (!(get_uvpt_entry(BUF) & PTE_PS) && read_tsc() - begin < TIMEOUT);
+
+    cprintf("thpbench: collapsed %lu ranges in %lu cycles, %lu scanned\n",
+            (unsigned long)(stat.thp_collapsed - start.thp_collapsed),
+            (unsigned long)(read_tsc() - begin),
+            (unsigned long)(stat.thp_scanned - start.thp_scanned));
+    if (!(get_uvpt_entry(BUF) & PTE_PS)) panic("range was not collapsed");
+    if (stat.thp_collapsed == start.thp_collapsed) panic("collapse was not counted");
+
+    check(0, NPAGES, 0);
+    fill(0xFF);
+    check(0, NPAGES, 0xFF);
+
+    /* Unmapping a part splits huge page */
+    res = sys_unmap_region(CURENVID, BUF, PAGE_SIZE);
+    if (res < 0) panic("sys_unmap_region: %i", res);
+    if (is_page_present(BUF)) panic("unmapped page is still present");
+    if (get_uvpt_entry(BUF + PAGE_SIZE) & PTE_PS) panic("huge page was not split");
+    check(1, NPAGES, 0xFF);
+
+    cprintf("thpbench: OK\n");
+}
@@ -0,0 +1,86 @@
+/* Show which envs use CPU.
+ * CPU accounting is read straight from envs[] mapped at UENVS,
+ * so sampling needs no system calls. Usage: top [samples] */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define INTERVAL        2000000000ULL /* TSC cycles between samples */
+#define DEFAULT_SAMPLES 5
+#define MAX_SHOWN       16
+
+static envid_t prev_id[NENV];
+static uint64_t prev_user[NENV], prev_kernel[NENV];
+static uint64_t used[NENV];
+static size_t order[NENV];
+
+static const char *
+status_name(unsigned status) {
+    static const char *names[] = {"FREE", "DYING", "RUNNABLE", "RUNNING", "BLOCKED"};
+    return status < sizeof(names) / sizeof(*names) ? names[status] : "?";
+}
+
+static void
+snapshot(void) {
+    for (size_t i = 0; i < NENV; i++) {
+        prev_id[i] = envs[i].env_id;
+        prev_user[i] = envs[i].env_user_cycles;
+        prev_kernel[i] = envs[i].env_kernel_cycles;
+    }
+}
+
+static void
+report(uint64_t elapsed) {
+    size_t n = 0;
+    for (size_t i = 0; i < NENV; i++) {
+        if (envs[i].env_status == ENV_FREE) continue;
+        /* Slot could have been reused since the last sample */
+        bool same = envs[i].env_id == prev_id[i];
+        used[i] = envs[i].env_user_cycles - (same ? prev_user[i] : 0) +
+                  envs[i].env_kernel_cycles - (same ? prev_kernel[i] : 0);
+
+        /* Busiest envs go first */
+        size_t j = n++;
+        for (; j > 0 && used[order[j - 1]] < used[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    cprintf("\n   ENVID STATUS   CLASS   %%USR  %%SYS    RUNS   VCSW  IVCSW  FAULTS\n");
+    for (size_t k = 0; k < MIN(n, (size_t)MAX_SHOWN); k++) {
+        size_t i = order[k];
+        const volatile struct Env *env = &envs[i];
+        bool same = env->env_id == prev_id[i];
+        uint64_t user = env->env_user_cycles - (same ? prev_user[i] : 0);
+        uint64_t kernel = env->env_kernel_cycles - (same ? prev_kernel[i] : 0);
+
+        char class[8];
+        if (env->env_weight)
+            snprintf(class, sizeof(class), "w%u", env->env_weight);
+        else
+            snprintf(class, sizeof(class), "p%u", env->env_priority);
+
+        cprintf("%08x %-8s %-6s %5lu %5lu %7u %6u %6u %7lu\n",
+                env->env_id, status_name(env->env_status), class,
+                (unsigned long)(user * 100 / elapsed), (unsigned long)(kernel * 100 / elapsed),
+                env->env_runs, env->env_voluntary_switches, env->env_involuntary_switches,
+                (unsigned long)(env->env_faults + env->env_user_faults));
+    }
+}
+
+void
+umain(int argc, char **argv) {
+    long samples = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_SAMPLES;
+
+    snapshot();
+    uint64_t last = read_tsc();
+    for (long i = 0; i < samples; i++) {
+        while (read_tsc() - last < INTERVAL)
+            sys_yield();
+
+        uint64_t now = read_tsc();
+        report(now - last);
+        snapshot();
+        last = now;
+    }
+}